@@ -0,0 +1,325 @@
+#! /usr/bin/env python3
+# -*- coding: utf-8; -*-
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import random
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+version = "v.0.1.0"
+
+"""
+    Benchmark suite for the `psplit` builtin of `simplesh`.
+
+    Generates synthetic inputs (large files with short and long lines, a few
+    large files, many small files and a stdin pipe), runs `psplit -v` over a
+    matrix of -b, -l, -s and -p values through `simplesh -c` and writes wall
+    time and MB/s per configuration as JSON, so that runs can be compared
+    across commits.
+"""
+
+
+################################################################################
+
+
+def info(*args):
+    print("{}:".format(os.path.basename(sys.argv[0])), *args)
+
+
+def panic(*args):
+    info(*args)
+    sys.exit(1)
+
+
+################################################################################
+
+
+SIZE_SUFFIXES = {'': 1, 'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+
+
+def parse_size(text):
+
+    """ Parse a size such as 4096, 64K or 16M. """
+
+    m = re.match(r'^(\d+)([KMG]?)$', text.strip().upper())
+    if not m:
+        raise argparse.ArgumentTypeError('Invalid size ' + text)
+    return int(m.group(1)) * SIZE_SUFFIXES[m.group(2)]
+
+
+def size_list(text):
+    return [parse_size(x) for x in text.split(',')]
+
+
+def int_list(text):
+    try:
+        return [int(x) for x in text.split(',')]
+    except ValueError:
+        raise argparse.ArgumentTypeError('Invalid list ' + text)
+
+
+def parse_arguments():
+
+    """ Parse command-line arguments. """
+
+    parser = argparse.ArgumentParser(
+        usage='%(prog)s [-h] [options]',
+        description=f'psplit benchmark suite {version}',
+        epilog='Example: %(prog)s --size 256M --procs 1,2,4,8 -r 5'
+    )
+
+    parser.add_argument('--shell', default='./simplesh',
+        help='simplesh binary (default: ./simplesh).')
+    parser.add_argument('--bytes', type=size_list, default='1M,16M',
+        help='Comma-separated -b values (default: 1M,16M).')
+    parser.add_argument('--lines', type=int_list, default='10000,100000',
+        help='Comma-separated -l values (default: 10000,100000).')
+    parser.add_argument('--bsizes', type=size_list, default='64K,1M',
+        help='Comma-separated -s values (default: 64K,1M).')
+    parser.add_argument('--procs', type=int_list, default='1,4',
+        help='Comma-separated -p values (default: 1,4).')
+    parser.add_argument('--size', type=parse_size, default='64M',
+        help='Size of each large input (default: 64M).')
+    parser.add_argument('--small', type=int, default=1000,
+        help='Number of 4 KiB inputs in the many-small-files set (default: 1000).')
+    parser.add_argument('--inputs', type=lambda s: s.split(','), default=None,
+        help='Comma-separated subset of inputs: ' + ','.join(INPUTS) + '.')
+    parser.add_argument('-r', '--repeat', type=int, default=3,
+        help='Runs per configuration; the median is reported (default: 3).')
+    parser.add_argument('--sync', default='file',
+        choices=['none', 'file', 'end', 'range'],
+        help='psplit --sync mode (default: file).')
+    parser.add_argument('-w', '--workdir',
+        default=os.path.join(tempfile.gettempdir(), 'simplesh-bench'),
+        help='Directory for inputs (kept between runs) and outputs.')
+    parser.add_argument('-o', '--output', default=None,
+        help='JSON results file (default: bench/results/<commit>.json).')
+
+    return parser.parse_args()
+
+
+################################################################################
+
+
+def make_lines(size, min_len, max_len, seed):
+
+    """ Build `size` bytes of lines of printable text of random length. """
+
+    rnd = random.Random(seed)
+    alphabet = b'abcdefghijklmnopqrstuvwxyz0123456789 '
+    text = bytes(rnd.choice(alphabet) for _ in range(2 * max_len))
+
+    # A pattern of up to 1 MiB of lines, repeated up to `size`
+    block = bytearray()
+    while len(block) < min(size, 1 << 20):
+        n = rnd.randint(min_len, max_len)
+        off = rnd.randrange(max_len)
+        block += text[off:off + n - 1] + b'\n'
+    data = bytes(block) * (size // len(block) + 1)
+    return data[:size]
+
+
+def write_input(path, data):
+
+    """ Write `data` to `path` unless an identical-size file is already there. """
+
+    if os.path.exists(path) and os.path.getsize(path) == len(data):
+        return
+    with open(path, 'wb') as f:
+        f.write(data)
+
+
+# Input sets. `generate_inputs` maps each one to its files (relative to the
+# input dir) and whether they reach psplit through a stdin pipe.
+INPUTS = ['short', 'long', 'few', 'small', 'pipe']
+
+
+def generate_inputs(args, indir):
+
+    """ Generate (or reuse) the synthetic inputs in `indir`. """
+
+    os.makedirs(indir, exist_ok=True)
+
+    short = make_lines(args.size, 8, 40, 1)
+    write_input(os.path.join(indir, 'short.txt'), short)
+    write_input(os.path.join(indir, 'long.txt'), make_lines(args.size, 1024, 8192, 2))
+
+    few = make_lines(args.size // 4, 8, 200, 3)
+    for i in range(4):
+        write_input(os.path.join(indir, 'few{}.txt'.format(i)), few)
+
+    smalldir = os.path.join(indir, 'small')
+    os.makedirs(smalldir, exist_ok=True)
+    small = make_lines(4096, 8, 80, 4)
+    for i in range(args.small):
+        write_input(os.path.join(smalldir, 's{}.txt'.format(i)), small)
+
+    return {
+        'short': (['short.txt'], False),
+        'long':  (['long.txt'], False),
+        'few':   (['few{}.txt'.format(i) for i in range(4)], False),
+        'small': ([os.path.join('small', 's{}.txt'.format(i)) for i in range(args.small)], False),
+        'pipe':  (['short.txt'], True),
+    }
+
+
+################################################################################
+
+
+TOTAL_RE = re.compile(r'^psplit: total: (\d+) bytes leídos, (\d+) escritos, (\d+) trozos, '
+                      r'([\d.]+) s, ([\d.]+) MB/s$', re.M)
+TIMES_RE = re.compile(r'^psplit: total: read ([\d.]+) s, write ([\d.]+) s, fsync ([\d.]+) s, '
+                      r'open ([\d.]+) s, io_uring ([\d.]+) s$', re.M)
+
+
+def run_psplit(args, indir, outdir, files, pipe, mode):
+
+    """ Run one psplit configuration and return its wall time and counters. """
+
+    shutil.rmtree(outdir, ignore_errors=True)
+    os.makedirs(outdir)
+
+    psplit = ['psplit', '-v', '--sync=' + args.sync, '-o', outdir] + mode
+    if pipe:
+        cmdline = 'cat {} | {}'.format(files[0], ' '.join(psplit))
+    else:
+        cmdline = ' '.join(psplit + files)
+
+    start = time.perf_counter()
+    proc = subprocess.run([args.shell, '-c', cmdline], cwd=indir,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+    out = proc.stdout.decode('utf-8', 'replace')
+
+    total = TOTAL_RE.search(out)
+    times = TIMES_RE.search(out)
+    if proc.returncode != 0 or not total or not times:
+        panic("Error: '{}' failed:\n{}{}".format(cmdline, out,
+              proc.stderr.decode('utf-8', 'replace')))
+
+    shutil.rmtree(outdir, ignore_errors=True)
+
+    return wall, {
+        'bytes_in': int(total.group(1)),
+        'bytes_out': int(total.group(2)),
+        'chunks': int(total.group(3)),
+        'time_s': float(total.group(4)),
+        'mb_s': float(total.group(5)),
+        'read_s': float(times.group(1)),
+        'write_s': float(times.group(2)),
+        'fsync_s': float(times.group(3)),
+        'open_s': float(times.group(4)),
+        'io_uring_s': float(times.group(5)),
+    }
+
+
+def git_commit():
+
+    """ Current commit (with a -dirty suffix) or 'unknown'. """
+
+    try:
+        commit = subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'],
+                                         stderr=subprocess.DEVNULL).decode().strip()
+        dirty = subprocess.run(['git', 'diff', '--quiet', 'HEAD', '--', '*.c'],
+                               stderr=subprocess.DEVNULL).returncode != 0
+        return commit + ('-dirty' if dirty else '')
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+################################################################################
+
+
+def main():
+
+    """ Main driver. """
+
+    info("Version: {}".format(version))
+
+    args = parse_arguments()
+    args.shell = os.path.abspath(args.shell)
+    if not os.access(args.shell, os.X_OK):
+        panic("Error: {} is not executable (run make first).".format(args.shell))
+
+    names = args.inputs or INPUTS
+    for name in names:
+        if name not in INPUTS:
+            panic("Error: Unknown input {}.".format(name))
+
+    commit = git_commit()
+    output = args.output or os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                         'results', commit + '.json')
+
+    indir = os.path.join(args.workdir, 'in')
+    outdir = os.path.join(args.workdir, 'out')
+    info("Generating inputs in {}".format(indir))
+    inputs = generate_inputs(args, indir)
+
+    modes = [['-b', str(b)] for b in args.bytes] + [['-l', str(l)] for l in args.lines]
+
+    results = []
+    for name in names:
+        files, pipe = inputs[name]
+        for mode in modes:
+            for bsize in args.bsizes:
+                for procs in args.procs:
+                    config = mode + ['-s', str(bsize), '-p', str(procs)]
+                    runs = [run_psplit(args, indir, outdir, files, pipe, config)
+                            for _ in range(args.repeat)]
+                    walls = [w for w, _ in runs]
+                    wall = statistics.median(walls)
+                    # Counters of the median run
+                    counters = sorted(runs, key=lambda r: r[0])[len(runs) // 2][1]
+                    mb_s = counters['bytes_in'] / wall / 1e6 if wall > 0 else 0.0
+
+                    results.append({
+                        'input': name,
+                        'args': config,
+                        'wall_s': round(wall, 6),
+                        'wall_runs_s': [round(w, 6) for w in walls],
+                        'mb_s': round(mb_s, 1),
+                        'psplit': counters,
+                    })
+                    print("{:6} {:28} {:8.3f} s {:8.1f} MB/s".format(
+                        name, ' '.join(config), wall, mb_s))
+
+    report = {
+        'version': version,
+        'commit': commit,
+        'date': datetime.datetime.now().isoformat(timespec='seconds'),
+        'host': platform.node(),
+        'kernel': platform.release(),
+        'cpus': os.cpu_count(),
+        'params': {
+            'size': args.size,
+            'small': args.small,
+            'repeat': args.repeat,
+            'sync': args.sync,
+            'cache': 'warm',
+        },
+        'results': results,
+    }
+
+    os.makedirs(os.path.dirname(os.path.abspath(output)), exist_ok=True)
+    with open(output, 'w') as f:
+        json.dump(report, f, indent=2)
+        f.write('\n')
+    info("Results written to {}".format(output))
+
+    return 0
+
+
+################################################################################
+
+
+if __name__ == "__main__":
+    sys.exit(main())
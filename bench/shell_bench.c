@@ -0,0 +1,369 @@
+/*
+ * Microbenchmarks de `simplesh`
+ *
+ * Mide por separado los costes propios del shell, llamando directamente a
+ * sus funciones (el fuente se incluye entero y su `main` se renombra):
+ *
+ * - parse: `parse_cmd` + `null_terminate` sobre líneas generadas.
+ * - exec:  lanzar y esperar una orden vacía por la rama EXEC de `run_cmd`.
+ * - pipe:  montar y esperar tuberías de N etapas (rama PIPE).
+ * - back:  lanzar órdenes en segundo plano (rama BACK) y esperar a que el
+ *          manejador de SIGCHLD las recoja.
+ *
+ * De cada medida se muestran percentiles en microsegundos.
+ */
+
+#define main simplesh_main
+#include "../simplesh.c"
+#undef main
+
+
+/* Opciones */
+static int g_iters = 1000;          // Repeticiones de exec, pipe y back
+static int g_parse_iters = 200000;  // Líneas analizadas
+static const char* g_exec = "true"; // Orden vacía
+static int g_stages[16] = {2, 4, 8};
+static int g_nstages = 3;
+
+/* Salida de resultados: stdout se redirige a /dev/null durante las medidas
+ * (BACK y el manejador de SIGCHLD escriben los pid en ella) */
+static FILE* g_out;
+
+
+// Instante actual en nanosegundos
+static uint64_t ahora()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int comparar(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+// Imprime los percentiles de las `n` medidas (en ns) de `t`, que ordena
+static void percentiles(const char* name, uint64_t* t, size_t n)
+{
+    static const double P[] = {0.50, 0.90, 0.99, 0.999};
+    double sum = 0;
+
+    qsort(t, n, sizeof(*t), comparar);
+    for (size_t i = 0; i < n; i++)
+        sum += t[i];
+
+    fprintf(g_out, "%-14s %9zu", name, n);
+    for (size_t i = 0; i < sizeof(P) / sizeof(P[0]); i++)
+        fprintf(g_out, " %10.2f", t[(size_t) (P[i] * (n - 1))] / 1e3);
+    fprintf(g_out, " %10.2f %10.2f\n", t[n - 1] / 1e3, sum / n / 1e3);
+}
+
+
+// Reserva `n` medidas
+static uint64_t* medidas(size_t n)
+{
+    uint64_t* t = malloc(n * sizeof(*t));
+
+    if (t == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return t;
+}
+
+
+/******************************************************************************
+ * parse
+ ******************************************************************************/
+
+
+#define PARSE_LINES 1024
+
+static const char* PALABRAS[] = {
+    "ls", "-l", "cat", "grep", "-v", "foo", "wc", "sort", "-n", "uniq",
+    "/usr/bin/env", "fichero.txt", "dir/sub/otro.c", "echo", "hola", "mundo",
+};
+#define NPALABRAS (sizeof(PALABRAS) / sizeof(PALABRAS[0]))
+
+
+// Añade a `s` una orden simple de 1 a 4 palabras, quizá con redirecciones
+static void generar_orden(char* s, size_t size)
+{
+    int n = 1 + rand() % 4;
+
+    for (int i = 0; i < n; i++)
+        snprintf(s + strlen(s), size - strlen(s), "%s ", PALABRAS[rand() % NPALABRAS]);
+    if (rand() % 4 == 0)
+        snprintf(s + strlen(s), size - strlen(s), "< entrada.txt ");
+    if (rand() % 4 == 0)
+        snprintf(s + strlen(s), size - strlen(s), rand() % 2 ? "> salida.txt " : ">> salida.txt ");
+}
+
+
+// Genera una línea con tuberías, listas, bloques y segundo plano
+static void generar_linea(char* s, size_t size)
+{
+    int nlist = 1 + rand() % 3;
+
+    s[0] = 0;
+    for (int l = 0; l < nlist; l++)
+    {
+        int npipe = 1 + rand() % 4;
+        int bloque = rand() % 5 == 0;
+
+        if (bloque)
+            snprintf(s + strlen(s), size - strlen(s), "( ");
+        for (int p = 0; p < npipe; p++)
+        {
+            if (p > 0)
+                snprintf(s + strlen(s), size - strlen(s), "| ");
+            generar_orden(s, size);
+        }
+        if (bloque)
+            snprintf(s + strlen(s), size - strlen(s), ") ");
+        // `&` sólo puede ir al final de la línea o antes de `;`
+        if (rand() % 4 == 0)
+            snprintf(s + strlen(s), size - strlen(s), "& ");
+        if (l + 1 < nlist)
+            snprintf(s + strlen(s), size - strlen(s), "; ");
+    }
+}
+
+
+static void bench_parse()
+{
+    static char lineas[PARSE_LINES][512];
+    char buf[512];
+    uint64_t* t = medidas(g_parse_iters);
+    uint64_t bytes = 0, total = 0;
+
+    srand(1);
+    for (int i = 0; i < PARSE_LINES; i++)
+        generar_linea(lineas[i], sizeof(lineas[i]));
+
+    for (int i = 0; i < g_parse_iters; i++)
+    {
+        const char* l = lineas[i % PARSE_LINES];
+        size_t len = strlen(l);
+
+        // `null_terminate` escribe en la línea: se analiza una copia
+        memcpy(buf, l, len + 1);
+
+        uint64_t t0 = ahora();
+        struct cmd* c = parse_cmd(buf);
+        null_terminate(c);
+        t[i] = ahora() - t0;
+
+        arena_reset();
+        bytes += len;
+        total += t[i];
+    }
+
+    percentiles("parse", t, g_parse_iters);
+    fprintf(g_out, "%-14s %.0f líneas/s, %.1f MB/s\n", "", g_parse_iters / (total / 1e9),
+            bytes / 1e6 / (total / 1e9));
+    free(t);
+}
+
+
+/******************************************************************************
+ * exec, pipe y back
+ ******************************************************************************/
+
+
+// Analiza `line` y mide `iters` ejecuciones con `run_cmd`
+static void bench_run(const char* name, const char* line, int iters)
+{
+    char buf[4096];
+    uint64_t* t = medidas(iters);
+
+    strcpy(buf, line);
+    struct cmd* c = parse_cmd(buf);
+    null_terminate(c);
+
+    // Calentamiento: la tabla hash de órdenes y la caché de páginas
+    for (int i = 0; i < 10; i++)
+        run_cmd(c);
+
+    for (int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = ahora();
+        run_cmd(c);
+        t[i] = ahora() - t0;
+    }
+
+    arena_reset();
+    percentiles(name, t, iters);
+    free(t);
+}
+
+
+// Tubería de `n` etapas con la orden vacía
+static void bench_pipe(int n)
+{
+    char line[4096] = "";
+    char name[32];
+
+    for (int i = 0; i < n; i++)
+        snprintf(line + strlen(line), sizeof(line) - strlen(line), "%s%s",
+                i ? " | " : "", g_exec);
+    snprintf(name, sizeof(name), "pipe %d", n);
+    bench_run(name, line, g_iters);
+}
+
+
+// Espera a que el manejador de SIGCHLD haya recogido todas las tareas en
+// segundo plano
+static void esperar_tareas()
+{
+    sigset_t one, prev;
+    int quedan;
+
+    sigemptyset(&one);
+    sigaddset(&one, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &one, &prev);
+    for (;;)
+    {
+        quedan = 0;
+        for (int i = 0; i < NUM_BG_PIDS; i++)
+            quedan |= BG_PIDS[i];
+        if (!quedan)
+            break;
+        sigsuspend(&prev);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+
+// Lanzamiento de NUM_BG_PIDS tareas en segundo plano (una medida por tarea)
+// y tiempo hasta recogerlas todas (una medida por tanda)
+static void bench_back()
+{
+    char buf[256];
+    int tandas = (g_iters + NUM_BG_PIDS - 1) / NUM_BG_PIDS;
+    uint64_t* lanzar = medidas((size_t) tandas * NUM_BG_PIDS);
+    uint64_t* recoger = medidas(tandas);
+    uint64_t total = 0;
+
+    snprintf(buf, sizeof(buf), "%s &", g_exec);
+    struct cmd* c = parse_cmd(buf);
+    null_terminate(c);
+
+    for (int k = 0; k < tandas; k++)
+    {
+        uint64_t t0 = ahora();
+        for (int i = 0; i < NUM_BG_PIDS; i++)
+        {
+            uint64_t t1 = ahora();
+            run_cmd(c);
+            lanzar[k * NUM_BG_PIDS + i] = ahora() - t1;
+        }
+        esperar_tareas();
+        recoger[k] = ahora() - t0;
+        total += recoger[k];
+    }
+
+    arena_reset();
+    percentiles("back spawn", lanzar, (size_t) tandas * NUM_BG_PIDS);
+    snprintf(buf, sizeof(buf), "back x%d+reap", NUM_BG_PIDS);
+    percentiles(buf, recoger, tandas);
+    fprintf(g_out, "%-14s %.0f tareas/s\n", "",
+            (double) tandas * NUM_BG_PIDS / (total / 1e9));
+    free(lanzar);
+    free(recoger);
+}
+
+
+/******************************************************************************
+ * main
+ ******************************************************************************/
+
+
+static void uso(char* prog)
+{
+    printf("Uso: %s [-n ITERS] [-P PARSE_ITERS] [-e CMD] [-s N1,N2,...] [-t TESTS] [-h]\n", prog);
+    printf("     -n ITERS  Repeticiones de exec, pipe y back (por defecto, 1000).\n");
+    printf("     -P ITERS  Líneas analizadas en parse (por defecto, 200000).\n");
+    printf("     -e CMD    Orden vacía de exec, pipe y back (por defecto, true).\n");
+    printf("     -s LISTA  Etapas de las tuberías (por defecto, 2,4,8).\n");
+    printf("     -t TESTS  Medidas, separadas por comas: parse,exec,pipe,back\n");
+    printf("               (por defecto, todas).\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* tests = "parse,exec,pipe,back";
+    char* s;
+    int opt, devnull;
+
+    while ((opt = getopt(argc, argv, "n:P:e:s:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': g_iters = atoi(optarg); break;
+            case 'P': g_parse_iters = atoi(optarg); break;
+            case 'e': g_exec = optarg; break;
+            case 't': tests = optarg; break;
+            case 's':
+                g_nstages = 0;
+                for (s = strtok(optarg, ","); s && g_nstages < 16; s = strtok(NULL, ","))
+                    g_stages[g_nstages++] = atoi(s);
+                break;
+            case 'h':
+            default:
+                uso(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (g_iters < 1 || g_parse_iters < 1 || strlen(g_exec) > 200)
+    {
+        uso(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < g_nstages; i++)
+        if (g_stages[i] < 1 || g_stages[i] > 64)
+        {
+            uso(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+
+    // Como en el `main` del shell
+    register_sigchld_handler();
+    update_cwd();
+
+    if ((g_out = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+    {
+        perror("fdopen");
+        exit(EXIT_FAILURE);
+    }
+    TRY( devnull = open("/dev/null", O_WRONLY) );
+    TRY( dup2(devnull, STDOUT_FILENO) );
+    TRY( close(devnull) );
+    setvbuf(g_out, NULL, _IOLBF, 0);
+
+    fprintf(g_out, "%-14s %9s %10s %10s %10s %10s %10s %10s\n", "(us)", "n",
+            "p50", "p90", "p99", "p99.9", "max", "media");
+
+    if (strstr(tests, "parse"))
+        bench_parse();
+    if (strstr(tests, "exec"))
+        bench_run("exec", g_exec, g_iters);
+    if (strstr(tests, "pipe"))
+        for (int i = 0; i < g_nstages; i++)
+            bench_pipe(g_stages[i]);
+    if (strstr(tests, "back"))
+        bench_back();
+
+    arena_destroy();
+    fclose(g_out);
+
+    return 0;
+}
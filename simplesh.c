@@ -18,6 +18,7 @@
 
 
 #define _POSIX_C_SOURCE 200809L /* IEEE 1003.1-2008 (véase /usr/include/features.h) */
+#define _GNU_SOURCE             /* copy_file_range, splice (Linux) */
 //#define NDEBUG                /* Traduce asertos y DMACROS a 'no ops' */
 
 #include <assert.h>
@@ -25,15 +26,29 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <pwd.h>
 #include <limits.h>
 #include <libgen.h>
+#include <spawn.h>
+#include <regex.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 // Biblioteca readline
 #include <readline/readline.h>
@@ -84,25 +99,73 @@ static int g_dbg_level = 0;
     } while( 0 )
 
 
-// Número máximo de argumentos de un comando
-#define MAX_ARGS 16
+// Número inicial de huecos para argumentos de un comando (crece bajo demanda)
+#define INIT_ARGS 16
 // Número de comandos internos
-#define NUM_INTERNAL_CMDS 5
+#define NUM_INTERNAL_CMDS 6
 // Número de pids en segundo plano máximo
 #define NUM_BG_PIDS 8
+// Número de cubetas de la tabla hash de comandos (potencia de 2)
+#define HASH_BUCKETS 64
+// Tamaño mínimo de cada bloque del arena de estructuras `cmd`
+#define ARENA_BLOCK_SIZE 4096
+// Tamaño del buffer de lectura en modo no interactivo
+#define BATCH_BUFSIZE (1 << 20)
+// Entradas de la cola de envío del motor io_uring de PSPLIT
+#define URING_ENTRIES 256
+// Huecos de la tabla de ficheros registrados del motor io_uring (trozos
+// abiertos a la vez)
+#define URING_SLOTS 64
+// Tamaño de las huge pages para los buffers de E/S de PSPLIT
+#define HUGE_PAGE_SIZE (2 << 20)
+// Tamaño del buffer de cada fichero de salida de PSPLIT en los modos -k y -r
+#define SALIDA_BUFSIZE (64 << 10)
+// Tamaño máximo de cada pieza que se encola para comprimir (-z)
+#define COMP_PIEZA (1 << 20)
+// Piezas en cola por hilo compresor antes de que el lector tenga que esperar
+#define COMP_PIEZAS_HILO 4
+// Tamaño del buffer de salida de cada hilo compresor
+#define COMP_BUFSIZE (256 << 10)
+
+// Clases de caracteres del analizador léxico
+#define CC_WHITESPACE (1 << 0)  // Delimitadores: " \t\r\n\v"
+#define CC_SYMBOL     (1 << 1)  // Caracteres especiales: "<|>&;()"
+
+// Tabla de clases indexada por byte: clasificar un carácter cuesta un acceso
+// a memoria en lugar de dos llamadas a `strchr`
+static const unsigned char CHAR_CLASS[256] = {
+    [' ']  = CC_WHITESPACE, ['\t'] = CC_WHITESPACE, ['\r'] = CC_WHITESPACE,
+    ['\n'] = CC_WHITESPACE, ['\v'] = CC_WHITESPACE,
+    ['<']  = CC_SYMBOL, ['|'] = CC_SYMBOL, ['>'] = CC_SYMBOL, ['&'] = CC_SYMBOL,
+    [';']  = CC_SYMBOL, ['('] = CC_SYMBOL, [')'] = CC_SYMBOL,
+};
 
-// Delimitadores
-static const char WHITESPACE[] = " \t\r\n\v";
-
-// Caracteres especiales
-static const char SYMBOLS[] = "<|>&;()";
+#define IS_WHITESPACE(c) (CHAR_CLASS[(unsigned char) (c)] & CC_WHITESPACE)
+#define IS_ARG_CHAR(c)   (!CHAR_CLASS[(unsigned char) (c)])
 
 //Comando internos
-static const char *INTERNAL_COMMANDS[] = {"exit", "cwd", "cd", "psplit", "bjobs"};
+static const char *INTERNAL_COMMANDS[] = {"exit", "cwd", "cd", "psplit", "bjobs", "hash"};
 
 //PID en segundo plano
 int BG_PIDS[NUM_BG_PIDS];
 
+// Entorno que heredan los comandos lanzados con `posix_spawn`
+extern char** environ;
+
+// Directorio de trabajo actual. Sólo `run_cd` lo cambia dentro del shell, así
+// que se obtiene al arrancar y tras cada `cd`
+static char g_cwd[PATH_MAX];
+
+// Nombre del usuario, resuelto una sola vez al arrancar
+static char* g_user = NULL;
+
+// Prompt actual: sólo se reconstruye cuando cambia `g_cwd`
+static char* g_prompt = NULL;
+static int g_prompt_stale = 1;
+
+// Error en la línea que se está analizando: `parse_cmd` la descarta
+static int g_parse_error = 0;
+
 
 /******************************************************************************
  * Funciones auxiliares
@@ -147,11 +210,45 @@ void panic(const char *fmt, ...)
 }
 
 
+// Actualiza la copia de `getcwd()` en `g_cwd` e invalida el prompt
+void update_cwd()
+{
+    if (!getcwd(g_cwd, PATH_MAX))
+    {
+        perror("getcwd");
+        exit(EXIT_FAILURE);
+    }
+    g_prompt_stale = 1;
+}
+
+
+// Resuelve el nombre del usuario con `getpwuid`, que puede consultar NSS,
+// LDAP, etc. Se llama una única vez al arrancar en modo interactivo.
+void resolve_user()
+{
+    struct passwd* passwd = getpwuid(getuid());
+
+    if(!passwd)
+    {
+        perror("getpwuid");
+        exit(EXIT_FAILURE);
+    }
+    if ((g_user = strdup(passwd->pw_name)) == NULL)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
 // `fork()` que muestra un mensaje de error si no se puede crear el hijo
 int fork_or_panic(const char* s)
 {
     int pid;
 
+    // Lo que quede en el buffer de stdout (p.ej. de un comando interno) se
+    // escribiría también desde el hijo
+    fflush(stdout);
     pid = fork();
     if(pid == -1)
         panic("%s failed: errno %d (%s)", s, errno, strerror(errno));
@@ -179,18 +276,20 @@ int fork_or_panic(const char* s)
 // *casting* forzado de tipo. Se consigue así polimorfismo básico en C.
 
 // Valores del campo `type` de las estructuras de datos `cmd`
-enum cmd_type { EXEC=1, REDR=2, PIPE=3, LIST=4, BACK=5, SUBS=6, INV=7 };
+enum cmd_type { EXEC=1, REDR=2, PIPE=3, LIST=4, BACK=5, SUBS=6, TIME=7, INV=8 };
 
 struct cmd { enum cmd_type type; };
 //Variable global de cmd
 struct cmd* cmd;
 
-// Comando con sus parámetros
+// Comando con sus parámetros. `argv` y `eargv` se reservan del arena y
+// crecen al doble cuando se llenan.
 struct execcmd {
     enum cmd_type type;
-    char* argv[MAX_ARGS];
-    char* eargv[MAX_ARGS];
+    char** argv;
+    char** eargv;
     int argc;
+    int max_args;
 };
 
 // Comando con redirección
@@ -204,11 +303,13 @@ struct redrcmd {
     int fd;
 };
 
-// Comandos con tubería
+// Tubería de N etapas. `status` guarda el estado de salida de cada etapa tras
+// ejecutarla.
 struct pipecmd {
     enum cmd_type type;
-    struct cmd* left;
-    struct cmd* right;
+    struct cmd** cmds;
+    int* status;
+    int ncmds;
 };
 
 // Lista de órdenes
@@ -230,6 +331,104 @@ struct subscmd {
     struct cmd* cmd;
 };
 
+// Orden precedida de `time`
+struct timecmd {
+    enum cmd_type type;
+    struct cmd* cmd;
+};
+
+
+/******************************************************************************
+ * Arena de memoria para las estructuras `cmd`
+ ******************************************************************************/
+
+
+// Las estructuras `cmd` de una línea de órdenes se reservan de un *arena*: una
+// lista de bloques contiguos de los que se van cortando nodos consecutivos.
+// Tras ejecutar la línea, `arena_reset` libera todos los nodos de golpe en
+// O(1) y los bloques se reutilizan para la línea siguiente.
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size;                // Bytes útiles en `data`
+    size_t used;                // Bytes ya reservados de `data`
+    max_align_t data[];
+};
+
+static struct arena_block* g_arena_head = NULL;    // Primer bloque
+static struct arena_block* g_arena_cur = NULL;     // Bloque en uso
+
+
+// Reserva `size` bytes inicializados a 0 del arena
+void* arena_alloc(size_t size)
+{
+    struct arena_block* b;
+    struct arena_block* prev;
+    void* ptr;
+
+    // Redondea al alineamiento máximo
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+    // Busca un bloque con espacio a partir del actual
+    prev = g_arena_cur;
+    for (b = g_arena_cur; b && b->used + size > b->size; b = b->next)
+    {
+        prev = b;
+        if (b->next)
+            b->next->used = 0;
+    }
+
+    if (b == NULL)
+    {
+        size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+        if ((b = malloc(sizeof(*b) + bsize)) == NULL)
+        {
+            perror("arena_alloc: malloc");
+            exit(EXIT_FAILURE);
+        }
+        b->next = NULL;
+        b->size = bsize;
+        b->used = 0;
+
+        if (prev)
+            prev->next = b;
+        else
+            g_arena_head = b;
+    }
+
+    g_arena_cur = b;
+    ptr = (char*) b->data + b->used;
+    b->used += size;
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+
+// Libera de golpe todo lo reservado del arena (sin devolver los bloques)
+void arena_reset()
+{
+    g_arena_cur = g_arena_head;
+    if (g_arena_cur)
+        g_arena_cur->used = 0;
+}
+
+
+// Devuelve los bloques del arena al sistema
+void arena_destroy()
+{
+    struct arena_block* b;
+    struct arena_block* next;
+
+    for (b = g_arena_head; b; b = next)
+    {
+        next = b->next;
+        free(b);
+    }
+    g_arena_head = g_arena_cur = NULL;
+}
+
 
 /******************************************************************************
  * Funciones para construir las estructuras de datos `cmd`
@@ -241,17 +440,58 @@ struct cmd* execcmd(void)
 {
     struct execcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("execcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
-    memset(cmd, 0, sizeof(*cmd));
+    cmd = arena_alloc(sizeof(*cmd));
     cmd->type = EXEC;
+    cmd->max_args = INIT_ARGS;
+    cmd->argv = arena_alloc(INIT_ARGS * sizeof(char*));
+    cmd->eargv = arena_alloc(INIT_ARGS * sizeof(char*));
 
     return (struct cmd*) cmd;
 }
 
+
+// Añade un argumento a un `cmd` de tipo `EXEC`, duplicando el tamaño de
+// `argv` y `eargv` si hace falta. Siempre queda un hueco libre para el NULL
+// final. El límite es el que impone el núcleo a `execve` (`ARG_MAX`), donde
+// cada argumento ocupa al menos su puntero y un byte: el último crecimiento
+// se ajusta a él y, si aun así no cabe, la línea se descarta.
+void execcmd_add_arg(struct execcmd* cmd, char* start_of_arg, char* end_of_arg)
+{
+    static long max_args = 0;
+    char** argv;
+    char** eargv;
+    long n;
+
+    if (cmd->argc + 1 >= cmd->max_args)
+    {
+        if (max_args == 0)
+        {
+            long arg_max = sysconf(_SC_ARG_MAX);
+            max_args = (arg_max > 0 ? arg_max : 131072) / (sizeof(char*) + 1);
+        }
+        if (cmd->max_args >= max_args)
+        {
+            if (!g_parse_error)
+                error("%s: demasiados argumentos\n", __func__);
+            g_parse_error = 1;
+            return;
+        }
+
+        n = cmd->max_args * 2L < max_args ? cmd->max_args * 2L : max_args;
+        argv = arena_alloc(n * sizeof(char*));
+        eargv = arena_alloc(n * sizeof(char*));
+        memcpy(argv, cmd->argv, cmd->argc * sizeof(char*));
+        memcpy(eargv, cmd->eargv, cmd->argc * sizeof(char*));
+        cmd->argv = argv;
+        cmd->eargv = eargv;
+        cmd->max_args = n;
+    }
+
+    cmd->argv[cmd->argc] = start_of_arg;
+    cmd->eargv[cmd->argc] = end_of_arg;
+    cmd->argc++;
+}
+
 // Construye una estructura `cmd` de tipo `REDR`
 struct cmd* redrcmd(struct cmd* subcmd,
         char* file, char* efile,
@@ -259,12 +499,7 @@ struct cmd* redrcmd(struct cmd* subcmd,
 {
     struct redrcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("redrcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
-    memset(cmd, 0, sizeof(*cmd));
+    cmd = arena_alloc(sizeof(*cmd));
     cmd->type = REDR;
     cmd->cmd = subcmd;
     cmd->file = file;
@@ -276,20 +511,17 @@ struct cmd* redrcmd(struct cmd* subcmd,
     return (struct cmd*) cmd;
 }
 
-// Construye una estructura `cmd` de tipo `PIPE`
-struct cmd* pipecmd(struct cmd* left, struct cmd* right)
+// Construye una estructura `cmd` de tipo `PIPE` con las `ncmds` etapas de
+// `cmds`
+struct cmd* pipecmd(struct cmd** cmds, int ncmds)
 {
     struct pipecmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("pipecmd: malloc");
-        exit(EXIT_FAILURE);
-    }
-    memset(cmd, 0, sizeof(*cmd));
+    cmd = arena_alloc(sizeof(*cmd));
     cmd->type = PIPE;
-    cmd->left = left;
-    cmd->right = right;
+    cmd->cmds = cmds;
+    cmd->ncmds = ncmds;
+    cmd->status = arena_alloc(ncmds * sizeof(int));
 
     return (struct cmd*) cmd;
 }
@@ -299,12 +531,7 @@ struct cmd* listcmd(struct cmd* left, struct cmd* right)
 {
     struct listcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("listcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
-    memset(cmd, 0, sizeof(*cmd));
+    cmd = arena_alloc(sizeof(*cmd));
     cmd->type = LIST;
     cmd->left = left;
     cmd->right = right;
@@ -317,12 +544,7 @@ struct cmd* backcmd(struct cmd* subcmd)
 {
     struct backcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("backcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
-    memset(cmd, 0, sizeof(*cmd));
+    cmd = arena_alloc(sizeof(*cmd));
     cmd->type = BACK;
     cmd->cmd = subcmd;
 
@@ -334,19 +556,25 @@ struct cmd* subscmd(struct cmd* subcmd)
 {
     struct subscmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("subscmd: malloc");
-        exit(EXIT_FAILURE);
-    }
-
-    memset(cmd, 0, sizeof(*cmd));
+    cmd = arena_alloc(sizeof(*cmd));
     cmd->type = SUBS;
     cmd->cmd = subcmd;
 
     return (struct cmd*) cmd;
 }
 
+// Construye una estructura `cmd` de tipo `TIME`
+struct cmd* timecmd(struct cmd* subcmd)
+{
+    struct timecmd* cmd;
+
+    cmd = arena_alloc(sizeof(*cmd));
+    cmd->type = TIME;
+    cmd->cmd = subcmd;
+
+    return (struct cmd*) cmd;
+}
+
 
 /******************************************************************************
  * Funciones para realizar el análisis sintáctico de la línea de órdenes
@@ -367,7 +595,7 @@ int get_token(char** start_of_str, char const* end_of_str,
 
     // Salta los espacios en blanco
     s = *start_of_str;
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && IS_WHITESPACE(*s))
         s++;
 
     // `start_of_token` apunta al principio del argumento (si no es NULL)
@@ -413,9 +641,7 @@ int get_token(char** start_of_str, char const* end_of_str,
             //            start_o|f_token                       end_o|f_token
 
             ret = 'a';
-            while (s < end_of_str &&
-                    !strchr(WHITESPACE, *s) &&
-                    !strchr(SYMBOLS, *s))
+            while (s < end_of_str && IS_ARG_CHAR(*s))
                 s++;
             break;
     }
@@ -425,7 +651,7 @@ int get_token(char** start_of_str, char const* end_of_str,
         *end_of_token = s;
 
     // Salta los espacios en blanco
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && IS_WHITESPACE(*s))
         s++;
 
     // Actualiza `start_of_str`
@@ -440,17 +666,17 @@ int get_token(char** start_of_str, char const* end_of_str,
 // (`delimiter`).
 //
 // El primer puntero pasado como parámero (`start_of_str`) avanza hasta el
-// primer carácter que no está en el conjunto de caracteres `WHITESPACE`.
+// primer carácter que no está en el conjunto de caracteres `CC_WHITESPACE`.
 //
 // `peek` devuelve un valor distinto de `NULL` si encuentra alguno de los
-// caracteres en `delimiter` justo después de los caracteres en `WHITESPACE`.
+// caracteres en `delimiter` justo después de los caracteres en `CC_WHITESPACE`.
 
 int peek(char** start_of_str, char const* end_of_str, char* delimiter)
 {
     char* s;
 
     s = *start_of_str;
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && IS_WHITESPACE(*s))
         s++;
     *start_of_str = s;
 
@@ -459,6 +685,7 @@ int peek(char** start_of_str, char const* end_of_str, char* delimiter)
 
 
 // Definiciones adelantadas de funciones
+void run_cmd(struct cmd*);
 struct cmd* parse_line(char**, char*);
 struct cmd* parse_pipe(char**, char*);
 struct cmd* parse_exec(char**, char*);
@@ -467,6 +694,28 @@ struct cmd* parse_redr(struct cmd*, char**, char*);
 struct cmd* null_terminate(struct cmd*);
 
 
+// `parse_time` consume la palabra reservada `time` si es lo siguiente en la
+// cadena (seguida de un espacio o del final) y devuelve 1; si no, devuelve 0
+// sin consumir nada. `time` sólo se reconoce al principio de una orden:
+// en `echo time` es un argumento más.
+
+int parse_time(char** start_of_str, char* end_of_str)
+{
+    char* s;
+
+    peek(start_of_str, end_of_str, "");
+    s = *start_of_str;
+
+    if (end_of_str - s < 4 || strncmp(s, "time", 4) != 0)
+        return 0;
+    if (s + 4 < end_of_str && !IS_WHITESPACE(s[4]))
+        return 0;
+
+    *start_of_str = s + 4;
+    return 1;
+}
+
+
 // `parse_cmd` realiza el *análisis sintáctico* de la línea de órdenes
 // introducida por el usuario.
 //
@@ -481,6 +730,7 @@ struct cmd* parse_cmd(char* start_of_str)
 
     end_of_str = start_of_str + strlen(start_of_str);
 
+    g_parse_error = 0;
     cmd = parse_line(&start_of_str, end_of_str);
 
     // Comprueba que se ha alcanzado el final de la línea de órdenes
@@ -490,6 +740,10 @@ struct cmd* parse_cmd(char* start_of_str)
 
     DPRINTF(DBG_TRACE, "END\n");
 
+    // Una línea con errores no se ejecuta
+    if (g_parse_error)
+        return NULL;
+
     return cmd;
 }
 
@@ -502,12 +756,18 @@ struct cmd* parse_cmd(char* start_of_str)
 // bloques de órdenes y/o redirecciones.  A continuación, `parse_line`
 // comprueba si la ejecución de la línea se realiza en segundo plano (con `&`)
 // o si la línea de órdenes contiene una lista de órdenes (con `;`).
+//
+// Si la línea empieza por la palabra `time`, todo lo que sigue hasta el
+// final de la línea (o del bloque) se mide como una única orden `TIME`.
 
 struct cmd* parse_line(char** start_of_str, char* end_of_str)
 {
     struct cmd* cmd;
     int delimiter;
 
+    if (parse_time(start_of_str, end_of_str))
+        return timecmd(parse_line(start_of_str, end_of_str));
+
     cmd = parse_pipe(start_of_str, end_of_str);
 
     while (peek(start_of_str, end_of_str, "&"))
@@ -537,20 +797,31 @@ struct cmd* parse_line(char** start_of_str, char* end_of_str)
 }
 
 
-// `parse_pipe` realiza el análisis sintáctico de una tubería de manera
-// recursiva si encuentra el delimitador de tuberías '|'.
+// `parse_pipe` realiza el análisis sintáctico de una tubería mientras
+// encuentre el delimitador de tuberías '|'.
 //
-// `parse_pipe` llama a `parse_exec` y `parse_pipe` de manera recursiva para
-// realizar el análisis sintáctico de todos los componentes de la tubería.
+// `parse_pipe` llama a `parse_exec` para cada etapa de la tubería y las
+// guarda, en orden, en un único vector que crece al doble cuando se llena.
 
 struct cmd* parse_pipe(char** start_of_str, char* end_of_str)
 {
     struct cmd* cmd;
+    struct cmd** cmds;
+    struct cmd** aux;
+    int ncmds, max_cmds;
     int delimiter;
 
     cmd = parse_exec(start_of_str, end_of_str);
 
-    if (peek(start_of_str, end_of_str, "|"))
+    if (!peek(start_of_str, end_of_str, "|"))
+        return cmd;
+
+    max_cmds = 4;
+    cmds = arena_alloc(max_cmds * sizeof(struct cmd*));
+    cmds[0] = cmd;
+    ncmds = 1;
+
+    while (peek(start_of_str, end_of_str, "|"))
     {
         if (cmd->type == EXEC && ((struct execcmd*) cmd)->argv[0] == 0)
             error("%s: error sintáctico: no se encontró comando\n", __func__);
@@ -559,11 +830,20 @@ struct cmd* parse_pipe(char** start_of_str, char* end_of_str)
         delimiter = get_token(start_of_str, end_of_str, 0, 0);
         assert(delimiter == '|');
 
-        // Construye el `cmd` para la tubería
-        cmd = pipecmd(cmd, parse_pipe(start_of_str, end_of_str));
+        if (ncmds == max_cmds)
+        {
+            aux = arena_alloc(max_cmds * 2 * sizeof(struct cmd*));
+            memcpy(aux, cmds, ncmds * sizeof(struct cmd*));
+            cmds = aux;
+            max_cmds *= 2;
+        }
+
+        cmd = parse_exec(start_of_str, end_of_str);
+        cmds[ncmds++] = cmd;
     }
 
-    return cmd;
+    // Construye el `cmd` para la tubería
+    return pipecmd(cmds, ncmds);
 }
 
 
@@ -576,7 +856,7 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
 {
     char* start_of_token;
     char* end_of_token;
-    int token, argc;
+    int token;
     struct execcmd* cmd;
     struct cmd* ret;
 
@@ -594,7 +874,6 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
     ret = parse_redr(ret, start_of_str, end_of_str);
 
     // Bucle para separar los argumentos de las posibles redirecciones
-    argc = 0;
     while (!peek(start_of_str, end_of_str, "|)&;"))
     {
         if ((token = get_token(start_of_str, end_of_str,
@@ -608,19 +887,15 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
 
         // Almacena el siguiente argumento reconocido. El primero es
         // el comando
-        cmd->argv[argc] = start_of_token;
-        cmd->eargv[argc] = end_of_token;
-        cmd->argc = ++argc;
-        if (argc >= MAX_ARGS)
-            panic("%s: demasiados argumentos\n", __func__);
+        execcmd_add_arg(cmd, start_of_token, end_of_token);
 
         // ¿Redirecciones después del comando?
         ret = parse_redr(ret, start_of_str, end_of_str);
     }
 
     // El comando no tiene más parámetros
-    cmd->argv[argc] = 0;
-    cmd->eargv[argc] = 0;
+    cmd->argv[cmd->argc] = 0;
+    cmd->eargv[cmd->argc] = 0;
 
     return ret;
 }
@@ -734,8 +1009,8 @@ struct cmd* null_terminate(struct cmd* cmd)
 
         case PIPE:
             pcmd = (struct pipecmd*) cmd;
-            null_terminate(pcmd->left);
-            null_terminate(pcmd->right);
+            for(i = 0; i < pcmd->ncmds; i++)
+                null_terminate(pcmd->cmds[i]);
             break;
 
         case LIST:
@@ -754,6 +1029,10 @@ struct cmd* null_terminate(struct cmd* cmd)
             null_terminate(scmd->cmd);
             break;
 
+        case TIME:
+            null_terminate(((struct timecmd*) cmd)->cmd);
+            break;
+
         case INV:
         default:
             panic("%s: estructura `cmd` desconocida\n", __func__);
@@ -763,72 +1042,191 @@ struct cmd* null_terminate(struct cmd* cmd)
 }
 
 /******************************************************************************
- * Free CMD
+ * Tabla hash de rutas de comandos
  ******************************************************************************/
 
-void free_cmd(struct cmd* cmd)
+
+// Como el `hash` de bash, `simplesh` recuerda la ruta absoluta de cada comando
+// externo que ha resuelto para no recorrer `$PATH` en cada ejecución. Una
+// entrada se invalida si cambia `$PATH` o si cambia el `mtime` del directorio
+// donde se encontró el comando (se ha añadido, borrado o renombrado algo).
+
+struct hash_entry {
+    char* name;                 // Nombre del comando (`argv[0]`)
+    char* path;                 // Ruta absoluta del ejecutable
+    struct timespec dir_mtime;  // `mtime` del directorio al resolverlo
+    int hits;                   // Veces que se ha usado la entrada
+    struct hash_entry* next;
+};
+
+static struct hash_entry* g_hash[HASH_BUCKETS];
+static char* g_hash_path = NULL;    // `$PATH` con el que se llenó la tabla
+static int g_hash_hits = 0;
+static int g_hash_misses = 0;
+
+
+// Función hash FNV-1a
+static unsigned hash_str(const char* s)
 {
-    struct execcmd* ecmd;
-    struct redrcmd* rcmd;
-    struct listcmd* lcmd;
-    struct pipecmd* pcmd;
-    struct backcmd* bcmd;
-    struct subscmd* scmd;
+    unsigned h = 2166136261u;
 
-    if(cmd == 0) return;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
 
-    switch(cmd->type)
+    return h & (HASH_BUCKETS - 1);
+}
+
+
+// Vacía la tabla hash de comandos
+void hash_clear()
+{
+    struct hash_entry* e;
+    struct hash_entry* next;
+
+    for (int i = 0; i < HASH_BUCKETS; i++)
     {
-        case EXEC:
-            ecmd = (struct execcmd*) cmd;
-            free(ecmd);
-            break;
+        for (e = g_hash[i]; e; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        g_hash[i] = NULL;
+    }
 
-        case REDR:
-            rcmd = (struct redrcmd*) cmd;
-            free_cmd(rcmd->cmd);
+    free(g_hash_path);
+    g_hash_path = NULL;
+}
 
-            free(rcmd);
-            break;
 
-        case LIST:
-            lcmd = (struct listcmd*) cmd;
+// Devuelve el `mtime` del directorio que contiene `path` en `ts`
+static int dir_mtime(const char* path, struct timespec* ts)
+{
+    char dir[PATH_MAX];
+    struct stat st;
 
-            free_cmd(lcmd->left);
-            free_cmd(lcmd->right);
+    if (strlen(path) >= sizeof(dir))
+        return -1;
+    strcpy(dir, path);
+    if (stat(dirname(dir), &st) == -1)
+        return -1;
+    *ts = st.st_mtim;
 
-            free(lcmd);
-            break;
+    return 0;
+}
 
-        case PIPE:
-            pcmd = (struct pipecmd*) cmd;
 
-            free_cmd(pcmd->left);
-            free_cmd(pcmd->right);
+// Busca `name` en los directorios de `path` como lo haría `execvp`. Devuelve
+// la ruta absoluta (reservada con `malloc`) o NULL si no se encuentra.
+static char* path_search(const char* name, const char* path)
+{
+    char candidate[PATH_MAX];
+    const char* dir;
+    const char* end;
+    struct stat st;
+    int len;
 
-            free(pcmd);
+    for (dir = path; ; dir = end + 1)
+    {
+        end = strchr(dir, ':');
+        if (!end)
+            end = dir + strlen(dir);
+
+        // Un elemento vacío de `$PATH` es el directorio actual
+        if (end == dir)
+            len = snprintf(candidate, sizeof(candidate), "./%s", name);
+        else
+            len = snprintf(candidate, sizeof(candidate), "%.*s/%s",
+                    (int) (end - dir), dir, name);
+
+        if (len < (int) sizeof(candidate) &&
+                access(candidate, X_OK) == 0 &&
+                stat(candidate, &st) == 0 && S_ISREG(st.st_mode))
+            return strdup(candidate);
+
+        if (*end == 0)
             break;
+    }
 
-        case BACK:
-            bcmd = (struct backcmd*) cmd;
+    return NULL;
+}
 
-            free_cmd(bcmd->cmd);
 
-            free(bcmd);
-            break;
+// `hash_lookup` devuelve la ruta absoluta del comando `name`, usando la
+// tabla hash si es posible. Los nombres con '/' no se buscan en `$PATH`.
+// Devuelve NULL si el comando no existe.
+const char* hash_lookup(const char* name)
+{
+    struct hash_entry** pe;
+    struct hash_entry* e;
+    struct timespec ts;
+    const char* path;
+    unsigned h;
 
-        case SUBS:
-            scmd = (struct subscmd*) cmd;
+    if (strchr(name, '/'))
+        return name;
 
-            free_cmd(scmd->cmd);
+    if ((path = getenv("PATH")) == NULL)
+        path = "/bin:/usr/bin";
 
-            free(scmd);
-            break;
+    // Si ha cambiado `$PATH` todas las entradas dejan de ser válidas
+    if (g_hash_path == NULL || strcmp(g_hash_path, path) != 0)
+    {
+        hash_clear();
+        if ((g_hash_path = strdup(path)) == NULL)
+        {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        case INV:
-        default:
-            panic("%s: estructura `cmd` desconocida\n", __func__);
+    h = hash_str(name);
+    for (pe = &g_hash[h]; (e = *pe) != NULL; pe = &e->next)
+    {
+        if (strcmp(e->name, name) != 0)
+            continue;
+
+        if (dir_mtime(e->path, &ts) == 0 &&
+                ts.tv_sec == e->dir_mtime.tv_sec &&
+                ts.tv_nsec == e->dir_mtime.tv_nsec)
+        {
+            e->hits++;
+            g_hash_hits++;
+            return e->path;
+        }
+
+        // El directorio ha cambiado: se descarta la entrada
+        *pe = e->next;
+        free(e->name);
+        free(e->path);
+        free(e);
+        break;
+    }
+
+    g_hash_misses++;
+
+    if ((e = malloc(sizeof(*e))) == NULL)
+    {
+        perror("hash_lookup: malloc");
+        exit(EXIT_FAILURE);
     }
+    memset(e, 0, sizeof(*e));
+
+    if ((e->path = path_search(name, path)) == NULL ||
+            dir_mtime(e->path, &e->dir_mtime) == -1 ||
+            (e->name = strdup(name)) == NULL)
+    {
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+
+    e->hits = 1;
+    e->next = g_hash[h];
+    g_hash[h] = e;
+
+    return e->path;
 }
 
 
@@ -871,7 +1269,7 @@ void handle_sigchld(int sig)
     while ((pid = waitpid(-1, 0, WNOHANG)) > 0) 
     {
         // Imprimimos por STDOUT el pid que ha finalizado
-        char buf[12];
+        char buf[16];
         sprintf(buf, "[%d]", pid);
         if ( write(STDOUT_FILENO, buf, strlen(buf)) == -1 )
         {
@@ -940,22 +1338,17 @@ int is_internal_cmd(char* cmd_name)
 // Comando CWD
 void run_cwd()
 {
-
-    char path[PATH_MAX];
-    if (!getcwd(path, PATH_MAX))
-    {
-        perror("getcwd");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("cwd: %s\n", path);
+    printf("cwd: %s\n", g_cwd);
 }
 
 
 // Comando EXIT
 void run_exit() 
 { 
-    free_cmd(cmd);
+    hash_clear();
+    arena_destroy();
+    free(g_prompt);
+    free(g_user);
     exit(EXIT_SUCCESS); 
 }
 
@@ -964,11 +1357,7 @@ void run_exit()
 void run_cd(char* path)
 {
     char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd)) == NULL)
-    {
-        perror("getcwd");
-        exit(EXIT_FAILURE);
-    }
+    strcpy(cwd, g_cwd);
 
     // cd
 	if (path == NULL)
@@ -1023,615 +1412,3347 @@ void run_cd(char* path)
             }
         }
 	}
+
+    update_cwd();
 }
 
 
-// Función complementaria a PSPLIT para la opcion -b
-void escribir_bytes(int fd, char* file, int NBYTES, int BSIZE)
-{
-    char data[BSIZE]; // Data buffer
+// Política de durabilidad de los ficheros de salida de PSPLIT (--sync)
+enum psplit_sync {
+    SYNC_NONE,      // Ninguna: el núcleo los escribe cuando quiera
+    SYNC_FILE,      // `fsync` de cada fichero antes de cerrarlo
+    SYNC_END,       // Un único `syncfs` al terminar
+    SYNC_RANGE,     // `sync_file_range` asíncrono de cada fichero al cerrarlo
+};
 
-    int read_from_source    = 0; // Bytes leídos del fichero original
-    int remaining           = 0; // Bytes restantes por escribir en el fichero
-    int total_written       = 0; // Bytes totales escritos del buffer
-    int is_incomplete       = 0; // Flag de fichero incompleto
-    int incomplete_fd       = 0; // Descriptor de fichero incompleto
-    int current_file        = 0; // Descriptor del fichero actual
-    int next_file_id        = 0; // Siguiente número de fichero
-    int bytes_in_buffer     = 0; // Bytes totales en el buffer
+static const char* PSPLIT_SYNC_NAMES[] = {"none", "file", "end", "range"};
 
-    // Leer mientras el fichero no esté vacío.
-    while ((read_from_source = read(fd, data, BSIZE)) != 0)
-    {
-        if ( read_from_source == -1 )
-        {
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
+// Motor de E/S de PSPLIT (--io)
+enum psplit_io {
+    IO_AUTO,        // io_uring sólo donde hoy se usa read/write
+    IO_URING,       // io_uring para toda entrada dividida secuencialmente
+    IO_SYNC,        // Nunca io_uring
+};
 
-        bytes_in_buffer = read_from_source;
-        //printf("Datos leidos: %d\n", bytes_in_buffer);
-        // Actúa como puntero al buffer de bytes, cada vez que escribamos
-        // bytes del buffer en el fichero, se sumará el número de bytes
-        // escritos a esta variable, por lo que la próxima vez 
-        // empezaremos a escribir en el fichero desde la posición
-        // data + total_written
-        total_written = 0;
+static const char* PSPLIT_IO_NAMES[] = {"auto", "uring", "sync"};
+
+// Configuración de la salida de PSPLIT, fijada por las opciones de cada
+// invocación y heredada por los procesos hijos
+static struct {
+    enum psplit_sync sync;
+    enum psplit_io io;
+    int depth;      // Buffers del anillo de lectura (-q)
+    int direct;     // Leer los ficheros con O_DIRECT (--direct)
+    int key_field;  // Campo por el que se reparten las líneas (-k, 0 si no)
+    char delim;     // Separador de campos (-t)
+    int nparts;     // Número de particiones de -k (-n)
+    int patron;     // Hay patrón de corte (-r)
+    regex_t regex;  // Patrón de corte compilado
+    int alinear;    // Los trozos de -C acaban en un separador de registro
+    char rdelim;    // Separador de registros de -C (-d)
+    int comp_level;     // Nivel de compresión gzip (-z, 0 si no se comprime)
+    int comp_threads;   // Hilos compresores por proceso
+    int dirfd;          // Directorio de los trozos (-o, AT_FDCWD si no)
+    int ancho;          // Cifras mínimas del número de trozo (-a)
+    const char* sufijo; // Sufijo tras el número de trozo (--suffix)
+    int stats;          // Medir y mostrar estadísticas (-v)
+} g_psplit;
+
+// Buffers de E/S de PSPLIT: una región alineada que se reserva la primera vez
+// que hace falta y se reutiliza para todos los ficheros de la invocación
+static struct {
+    char* base;
+    size_t len;
+} g_psplit_buf;
+
+// Estadísticas de PSPLIT (-v) de una entrada o de toda la invocación. Los
+// tiempos, en nanosegundos, suman lo que tarda cada llamada: con io_uring
+// las lecturas, escrituras, fsync y aperturas van juntas en `ns_uring`, y con
+// mmap la lectura queda dentro de las escrituras (fallos de página).
+struct psplit_stats {
+    unsigned long long bytes_in;    // Bytes leídos de la entrada
+    unsigned long long bytes_out;   // Bytes escritos en los trozos
+    unsigned long long chunks;      // Trozos creados
+    unsigned long long ns_read;
+    unsigned long long ns_write;
+    unsigned long long ns_sync;     // fsync, sync_file_range y syncfs
+    unsigned long long ns_open;     // open y fallocate de los trozos
+    unsigned long long ns_uring;    // Esperas en io_uring_enter
+    unsigned long long ns_wall;     // Tiempo transcurrido
+};
 
-        // Si el fichero está incompleto
-        if (is_incomplete)
-        {
-            // Si faltan más bytes por escribir de los que hay en el buffer
-            if (remaining > bytes_in_buffer)
-            {
-                int aux = write(current_file, data, bytes_in_buffer);
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
+// Contadores del proceso. Los hilos lector y compresores también los
+// actualizan, así que se suman con operaciones atómicas.
+static struct psplit_stats g_stats;
 
-                total_written += aux;
-                remaining -= bytes_in_buffer;
-                bytes_in_buffer = 0;
-            }
-            else
-            {
-                int aux = write(current_file, data, remaining);
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
+// Mensaje de un proceso hijo de PSPLIT con sus contadores. Cabe en PIPE_BUF,
+// así que cada `write` en la tubería es atómico.
+struct stats_msg {
+    int file;       // Índice de la entrada
+    int worker;     // Hueco o número del proceso
+    struct psplit_stats s;
+};
 
-                total_written += aux;
+// Tubería de los hijos de -p hacia el padre (-1 si no hay)
+static int g_stats_pipe[2] = {-1, -1};
 
-                
-                if ( fsync(current_file) == -1 )
-                {
-                    perror("fsync");
-                    exit(EXIT_FAILURE);
-                }
-                
-                if ( close(current_file) == -1 )
-                {
-                    perror("close");
-                    exit(EXIT_FAILURE);
-                }
-                
-                is_incomplete = 0;
-                bytes_in_buffer -= remaining;
-                
-            }
-        }
 
-        // Mientras queden bytes en el buffer...
-        while (bytes_in_buffer > 0)
-        {
-            // Construimos el nombre del nuevo fichero
-            char file_name[32];
-            sprintf(file_name, "%s%d", file, next_file_id);
-            next_file_id++;
+// Instante actual en nanosegundos, o 0 sin -v para no pagar el reloj
+unsigned long long stats_reloj()
+{
+    struct timespec ts;
 
-            // Abrimos el fichero
-            current_file = open(file_name, O_CREAT|O_RDWR|O_TRUNC, S_IRWXU);
+    if (!g_psplit.stats)
+        return 0;
 
-            if (current_file < 0)
-            {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-            // Si el tamaño en bytes del fichero es mayor que los bytes
-            // que tenemos actualmente en el buffer, el fichero quedará
-            // incompleto y todos los bytes del buffer se consumirán
-            if (NBYTES > bytes_in_buffer)
-            {
-                int aux = write(current_file, data + total_written, bytes_in_buffer);
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
-                
-                total_written += aux;
-                is_incomplete = 1;
-                remaining = NBYTES - bytes_in_buffer;
-                bytes_in_buffer = 0;
-            }
-            else
-            {
-                int aux = write(current_file, data + total_written, NBYTES);
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
 
-                total_written += aux;
-                
-                if ( fsync(current_file) == -1 )
-                {
-                    perror("fsync");
-                    exit(EXIT_FAILURE);
-                }
-                
-                if ( close(current_file) == -1 )
-                {
-                    perror("close");
-                    exit(EXIT_FAILURE);
-                }
+// Suma `n` al contador `*c` (sólo con -v)
+void stats_sumar(unsigned long long* c, unsigned long long n)
+{
+    if (g_psplit.stats)
+        __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
 
-                bytes_in_buffer -= NBYTES;
-                
-            }
-        }
-    }
+
+// Suma al contador `*c` el tiempo transcurrido desde `t0` (de `stats_reloj`)
+void stats_tiempo(unsigned long long* c, unsigned long long t0)
+{
+    if (g_psplit.stats)
+        __atomic_fetch_add(c, stats_reloj() - t0, __ATOMIC_RELAXED);
 }
 
 
-// Función complementaria a PSPLIT para la opción -l
-// Devuelve el número de bytes que tiene que escribir dicha opción
-int comprobar_linea(char* DATOS, int escritos, int lineas, int bytes_leidos)
+// Acumula los contadores `b` en `a`
+void stats_acumular(struct psplit_stats* a, const struct psplit_stats* b)
+{
+    a->bytes_in  += b->bytes_in;
+    a->bytes_out += b->bytes_out;
+    a->chunks    += b->chunks;
+    a->ns_read   += b->ns_read;
+    a->ns_write  += b->ns_write;
+    a->ns_sync   += b->ns_sync;
+    a->ns_open   += b->ns_open;
+    a->ns_uring  += b->ns_uring;
+}
+
+
+// Imprime los contadores `s` de `name`. Se vacía stdout para que los hijos
+// que cree después PSPLIT no hereden la línea sin escribir.
+void stats_imprimir(const char* name, const struct psplit_stats* s)
+{
+    double secs = s->ns_wall / 1e9;
+
+    printf("psplit: %s: %llu bytes leídos, %llu escritos, %llu trozos, %.3f s, "
+            "%.1f MB/s\n", name, s->bytes_in, s->bytes_out, s->chunks, secs,
+            secs > 0 ? s->bytes_in / 1e6 / secs : 0.0);
+    printf("psplit: %s: read %.3f s, write %.3f s, fsync %.3f s, open %.3f s, "
+            "io_uring %.3f s\n", name, s->ns_read / 1e9, s->ns_write / 1e9,
+            s->ns_sync / 1e9, s->ns_open / 1e9, s->ns_uring / 1e9);
+    fflush(stdout);
+}
+
+
+// Pone a cero los contadores de un proceso hijo recién creado y devuelve el
+// instante en que empieza
+unsigned long long stats_empezar()
+{
+    memset(&g_stats, 0, sizeof(g_stats));
+    return stats_reloj();
+}
+
+
+// Envía al padre los contadores del proceso hijo que empezó en `t0`, que ha
+// dividido la entrada `file` (-1 si sólo una parte) como proceso `worker`
+void stats_enviar(int file, int worker, unsigned long long t0)
 {
-    int leidas = 0;
-    int cont = -1;
-    for(int i = escritos; i<bytes_leidos; i++)
+    struct stats_msg m = { file, worker, g_stats };
+
+    if (g_stats_pipe[1] == -1)
+        return;
+
+    m.s.ns_wall = stats_reloj() - t0;
+    if (write(g_stats_pipe[1], &m, sizeof(m)) != sizeof(m))
     {
-        if(DATOS[i] ==  '\n')
-        {
-            cont = (i-escritos)+1;
-            leidas++;
-        }
-        if(leidas == lineas)
-        {
-            cont = (i-escritos)+1;
-            break;
-        }
+        perror("write");
+        exit(EXIT_FAILURE);
     }
-    return cont;
 }
 
 
-// Función complementaria a PSPLIT para la opción -l
-// Devuelve el número de lineas existen entre los bytes que vamos a escribir
-int contar_lineas(char* DATOS, int escritos, int bytes_escribir)
+// Recoge los mensajes que los hijos han dejado en la tubería: imprime los
+// contadores de cada entrada completa de `names`, los suma a `total` y
+// acumula en `w` los de cada proceso (con el tiempo ocupado en `ns_wall`).
+// El extremo de lectura no bloquea: un hijo que muere por un error no manda
+// nada.
+void stats_recoger(char** names, struct psplit_stats* total, struct psplit_stats* w)
 {
-    int cont = 0;
-    for (int i = escritos; i<escritos+bytes_escribir; i++) 
+    struct stats_msg m;
+    ssize_t n;
+
+    if (g_stats_pipe[0] == -1)
+        return;
+
+    while ((n = read(g_stats_pipe[0], &m, sizeof(m))) == sizeof(m))
     {
-        if(DATOS[i] == '\n')
-        {
-            cont++;
-        }
+        if (m.file >= 0)
+            stats_imprimir(names[m.file], &m.s);
+        stats_acumular(total, &m.s);
+        stats_acumular(&w[m.worker], &m.s);
+        w[m.worker].ns_wall += m.s.ns_wall;
+    }
+    if (n == -1 && errno != EAGAIN)
+    {
+        perror("read");
+        exit(EXIT_FAILURE);
     }
-    return cont;
 }
 
 
-// Función complementaria a PSPLIT para la opción -l
-void escribir_lineas(int fd, char* file, int NLINES, int BSIZE) 
+// Imprime el uso de cada uno de los `n` procesos de -p a partir de sus
+// contadores acumulados `w` y de los `total` nanosegundos que duró el reparto
+void stats_procesos(const struct psplit_stats* w, int n, unsigned long long total)
 {
-    char data[BSIZE]; // Data buffer
+    for (int k = 0; k < n; k++)
+        printf("psplit: proceso %d: %llu bytes escritos, %llu trozos, ocupado %.3f s "
+                "(%.0f%%)\n", k, w[k].bytes_out, w[k].chunks, w[k].ns_wall / 1e9,
+                total > 0 ? 100.0 * w[k].ns_wall / total : 0.0);
+}
 
-    int read_from_source    = 0; // Bytes leídos del fichero original
-    int remaining           = NLINES; // Lineas restantes por escribir en el fichero
-    int total_written       = 0; // Bytes totales escritos del buffer
-    int is_incomplete       = 0; // Flag de fichero incompleto
-    int incomplete_fd       = 0; // Descriptor de fichero incompleto
-    int current_file        = 0; // Descriptor del fichero actual
-    int next_file_id        = 0; // Siguiente número de fichero
-    int bytes_in_buffer     = 0; // Bytes totales en el buffer
 
-    // Leer mientras el fichero no esté vacío.
-    while ((read_from_source = read(fd, data, BSIZE)) != 0)
+// Libera los buffers de E/S de PSPLIT
+void liberar_buffers()
+{
+    if (g_psplit_buf.base && munmap(g_psplit_buf.base, g_psplit_buf.len) == -1)
     {
-        if (read_from_source == -1)
-        {
-            perror("read");
-            exit(EXIT_FAILURE);
-        }
-
-        bytes_in_buffer = read_from_source;
-        // Actúa como puntero al buffer de bytes, cada vez que escribamos
-        // bytes del buffer en el fichero, se sumará el número de bytes
-        // escritos a esta variable, por lo que la próxima vez 
-        // empezaremos a escribir en el fichero desde la posición
-        // data + total_written
-        total_written = 0;
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    g_psplit_buf.base = NULL;
+    g_psplit_buf.len = 0;
+}
 
-        // Si el fichero está incompleto
-        if (is_incomplete)
-        {
-            int comprobacion = comprobar_linea(data, total_written, remaining, bytes_in_buffer);
-            int lineas_comprobadas = contar_lineas(data, total_written, comprobacion);
-            if (comprobacion == -1 || lineas_comprobadas < remaining)
-            {
-                int aux = write(incomplete_fd, data, bytes_in_buffer);
-                
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
 
-                total_written += aux;
-                remaining -= lineas_comprobadas;
-                bytes_in_buffer = 0;
-            }
-            else
-            {
-                int aux = write(incomplete_fd, data, comprobacion);
-                
-                if ( aux == -1 ) 
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
+// Devuelve al menos `len` bytes de buffers de E/S para PSPLIT, alineados a
+// página o, a partir de HUGE_PAGE_SIZE, a huge page (con MADV_HUGEPAGE para
+// que el núcleo los respalde con páginas grandes). La región sólo se cambia
+// por otra si se pide más de lo que ya hay.
+char* reservar_buffers(size_t len)
+{
+    size_t align = len >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_len;
+    char *p, *base;
 
-                total_written += aux;
+    len = (len + align - 1) & ~(align - 1);
+    if (len <= g_psplit_buf.len)
+        return g_psplit_buf.base;
 
-                if ( fsync(incomplete_fd) == -1 )
-                {
-                    perror("fsync");
-                    exit(EXIT_FAILURE);
-                }
+    liberar_buffers();
 
-                if ( close(incomplete_fd) == -1 )
-                {
-                    perror("close");
-                    exit(EXIT_FAILURE);
-                }
+    // Se reserva de más para poder recortar hasta el alineamiento pedido
+    map_len = len + align;
+    p = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    base = (char*) (((uintptr_t) p + align - 1) & ~(uintptr_t) (align - 1));
+    if (base > p)
+        munmap(p, base - p);
+    munmap(base + len, p + map_len - (base + len));
 
-                is_incomplete = 0;
-                remaining = NLINES;
-                bytes_in_buffer -= comprobacion;
-            }
-        }
+    if (align == HUGE_PAGE_SIZE)
+        madvise(base, len, MADV_HUGEPAGE);
 
-        // Mientras queden bytes en el buffer...
-        while (bytes_in_buffer > 0)
-        {
-            // Construimos el nombre del nuevo fichero
-            char file_name[32];
-            sprintf(file_name, "%s%d", file, next_file_id);
-            next_file_id++;
+    g_psplit_buf.base = base;
+    g_psplit_buf.len = len;
 
-            // Abrimos el fichero
-            current_file = open(file_name, O_CREAT|O_RDWR|O_TRUNC, S_IRWXU);
+    return base;
+}
 
-            if ( current_file < 0 ) 
-            {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
 
-            int comprobacion = comprobar_linea(data, total_written, remaining, bytes_in_buffer);
-            int lineas_comprobadas = contar_lineas(data, total_written, comprobacion);
-            if (lineas_comprobadas < remaining)
-            {
-                int aux = write(current_file, data + total_written, bytes_in_buffer);
-                
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
+// Indica si `fd` se abrió con O_DIRECT
+int es_directa(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
 
-                total_written += aux;
-                is_incomplete = 1;
-                incomplete_fd = current_file;
-                remaining -= lineas_comprobadas;
-                bytes_in_buffer = 0;
-            }
-            else
-            {
-                int aux = write(current_file, data + total_written, comprobacion);
-                
-                if ( aux == -1 )
-                {
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
+    return flags != -1 && (flags & O_DIRECT);
+}
 
-                total_written += aux;
 
-                if ( fsync(current_file) == -1) 
-                {
-                    perror("fsync");
-                    exit(EXIT_FAILURE);
-                }
+// Abre el fichero de entrada `name`. Con --direct se pide O_DIRECT para no
+// llenar la caché de páginas con entradas mayores que la memoria; si el
+// sistema de ficheros no lo admite (tmpfs...) se abre normalmente.
+int abrir_entrada(char* name)
+{
+    int fd = -1;
 
-                if ( close(current_file) == -1 )
-                {
-                    perror("close");
-                    exit(EXIT_FAILURE);
-                }
+    if (g_psplit.direct)
+        fd = open(name, O_RDONLY|O_DIRECT);
+    if (fd == -1 && (!g_psplit.direct || errno == EINVAL))
+        fd = open(name, O_RDONLY);
 
-                bytes_in_buffer -= comprobacion;
-                remaining = NLINES;
-            }
-        }
+    if ( fd < 0 )
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
     }
+
+    return fd;
 }
 
 
-// Comando PSPLIT
-void run_psplit(struct execcmd* ecmd)
+// Lector de la entrada de PSPLIT por bloques de BSIZE bytes. Con una
+// profundidad mayor que 1 (-q) un hilo lector llena un anillo de `depth`
+// buffers mientras quien llama (el escritor) vacía los ya leídos en los
+// ficheros de salida, de modo que la latencia de las lecturas (alta en
+// sistemas de ficheros en red) se solapa con la de las escrituras.
+struct lector {
+    int fd;
+    int BSIZE;
+    int depth;              // Buffers del anillo (1: lectura síncrona)
+    char* bufs;             // `depth` buffers de BSIZE bytes
+    ssize_t* lens;          // Resultado de la lectura de cada buffer
+    int* errs;              // `errno` de las lecturas fallidas
+    unsigned llenos;        // Buffers leídos y aún no liberados
+    unsigned leido;         // Siguiente buffer que llenará el lector
+    unsigned escrito;       // Siguiente buffer que vaciará el escritor
+    int en_uso;             // El escritor tiene un buffer sin liberar
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t hilo;
+};
+
+
+// Hilo lector: lee bloques mientras haya buffers libres en el anillo y
+// termina tras entregar el fin de fichero o un error
+void* lector_hilo(void* arg)
 {
-    int opt;
-    optind = 1;
+    struct lector* l = arg;
+    ssize_t n;
+
+    do {
+        pthread_mutex_lock(&l->mutex);
+        while (l->llenos == (unsigned) l->depth)
+            pthread_cond_wait(&l->cond, &l->mutex);
+        pthread_mutex_unlock(&l->mutex);
+
+        // El buffer es sólo del lector hasta que se cuenta como lleno
+        unsigned i = l->leido % l->depth;
+        unsigned long long t0 = stats_reloj();
+        n = read(l->fd, l->bufs + (size_t) i * l->BSIZE, l->BSIZE);
+        stats_tiempo(&g_stats.ns_read, t0);
+        l->lens[i] = n;
+        l->errs[i] = errno;
+
+        pthread_mutex_lock(&l->mutex);
+        l->leido++;
+        l->llenos++;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->mutex);
+    } while (n > 0);
+
+    return NULL;
+}
 
-    /* Tamaño máximo del buffer */
-    static int MAX_BSIZE = 1048576;
 
-    /* Valores por defecto */
-    int NLINES  = 0;
-    int BSIZE   = 1024;
-    int PROCS   = 1;
-    int NBYTES  = 1024;
-    
-    while ((opt = getopt(ecmd->argc, ecmd->argv, "l:b:s:p:h")) != -1)
+// Prepara la lectura de `fd` con un anillo de `depth` buffers
+void lector_abrir(struct lector* l, int fd, int BSIZE, int depth)
+{
+    sigset_t all, old;
+
+    memset(l, 0, sizeof(*l));
+    l->fd = fd;
+    l->BSIZE = BSIZE;
+    l->depth = depth;
+    l->bufs = reservar_buffers((size_t) depth * BSIZE);
+    l->lens = malloc(depth * sizeof(ssize_t));
+    l->errs = malloc(depth * sizeof(int));
+    if (l->lens == NULL || l->errs == NULL)
     {
-        switch (opt)
-        {
-            case 'l': { NLINES = atoi(optarg); break; }
-            case 'b': { NBYTES = atoi(optarg); break; }
-            case 's': { BSIZE  = atoi(optarg); break; }
-            case 'p': { PROCS  = atoi(optarg); break; }
-            case 'h':
-                printf("Uso: %s [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n", ecmd->argv[0]);
-                printf("     Opciones:\n");
-                printf("     -l NLINES Número máximo de líneas por fichero.\n");
-                printf("     -b NBYTES Número máximo de bytes por fichero.\n");
-                printf("     -s BSIZE  Tamaño en bytes de los bloques leídos de [FILEn] o stdin.\n");
-                printf("     -p PROCS  Número máximo de procesos simultáneos.\n");
-                printf("     -h        Ayuda\n\n");
-                return;
-
-            default:
-                printf("Uso: %s [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n", ecmd->argv[0]);
-                return;
-        }   
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
 
-    if (NLINES != 0 && NBYTES != 1024)
-    {
-        printf("%s: Opciones incompatibles\n", ecmd->argv[0]);
+    if (depth == 1)
         return;
-    }
 
-    if (BSIZE < 1 || BSIZE > MAX_BSIZE)
-    {
-        printf("%s: Opción -s no válida\n", ecmd->argv[0]);
-        return;   
-    }
+    pthread_mutex_init(&l->mutex, NULL);
+    pthread_cond_init(&l->cond, NULL);
 
-    if (PROCS < 1)
+    // Las señales (SIGCHLD, SIGINT...) las sigue atendiendo el hilo principal
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    errno = pthread_create(&l->hilo, NULL, lector_hilo, l);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno != 0)
     {
-        printf("%s: Opción -p no válida\n", ecmd->argv[0]);
-        return;
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
     }
+}
 
-    /*
-     * fork(psplit(f1); fork(psplit(f2)); ... ; fork(psplit(fn)))
-     * Hacer tantos fork como se pueda (depende de NPROCS)
-     * Una vez que no se puedan procesar más ficheros pero aún queden
-     * ficheros por procesar, habrá que esperar a que acabe el más
-     * antigüo.
-     *
-     * Almacenar los PID de los procesos que se lanzan para saber si ha
-     * finalizado el más antigüo.
-     *
-     * Si no quedan más ficheros se finaliza el bucle y se espera (wait())
-     * a los procesos en vuelo.
-     */
-
-    int num_files = ecmd->argc - optind;
-    char* file_names[num_files];
 
-    /* Almacenar nombre de los ficheros. */
-    for (int i = optind, index = 0; i < ecmd->argc; i++, index++)
-        file_names[index] = ecmd->argv[i];
+// Devuelve en `*data` el siguiente bloque de la entrada y sus bytes (0 al
+// final). El bloque anterior se libera para que el lector lo reutilice.
+ssize_t lector_siguiente(struct lector* l, char** data)
+{
+    unsigned i = l->escrito % l->depth;
 
-    // Si no hay ficheros, leer de la entrada estándar
-    if (num_files == 0)
+    if (l->depth == 1)
     {
-        if (NBYTES != 1024) escribir_bytes(STDIN_FILENO, "stdin", NBYTES, BSIZE);
-        else if (NLINES != 0) escribir_lineas(STDIN_FILENO, "stdin", NLINES, BSIZE);
-        else escribir_bytes(STDIN_FILENO, "stdin", NBYTES, BSIZE);
+        unsigned long long t0 = stats_reloj();
+        l->lens[i] = read(l->fd, l->bufs, l->BSIZE);
+        stats_tiempo(&g_stats.ns_read, t0);
+    }
+    else
+    {
+        pthread_mutex_lock(&l->mutex);
+        if (l->en_uso)
+        {
+            l->llenos--;
+            l->escrito++;
+            i = l->escrito % l->depth;
+            pthread_cond_broadcast(&l->cond);
+        }
+        while (l->llenos == 0)
+            pthread_cond_wait(&l->cond, &l->mutex);
+        l->en_uso = 1;
+        pthread_mutex_unlock(&l->mutex);
+        errno = l->errs[i];
+    }
+
+    if (l->lens[i] == -1)
+    {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+
+    *data = l->bufs + (size_t) i * l->BSIZE;
+    stats_sumar(&g_stats.bytes_in, l->lens[i]);
+    return l->lens[i];
+}
+
+
+// Espera al hilo lector, que ya ha entregado el fin de fichero, y libera el
+// anillo
+void lector_cerrar(struct lector* l)
+{
+    if (l->depth > 1)
+    {
+        pthread_join(l->hilo, NULL);
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->mutex);
+    }
+    free(l->lens);
+    free(l->errs);
+}
+
+
+// Fuerza a disco según --sync y cierra un fichero de salida
+void cerrar_fichero(int out)
+{
+    unsigned long long t0 = stats_reloj();
+
+    switch (g_psplit.sync)
+    {
+        case SYNC_FILE:
+            if ( fsync(out) == -1 )
+            {
+                perror("fsync");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case SYNC_RANGE:
+            // Inicia la escritura de todo el fichero sin esperar a que acabe
+            if ( sync_file_range(out, 0, 0, SYNC_FILE_RANGE_WRITE) == -1 )
+            {
+                perror("sync_file_range");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case SYNC_NONE:
+        case SYNC_END:
+            break;
+    }
+    stats_tiempo(&g_stats.ns_sync, t0);
+
+    if ( close(out) == -1 )
+    {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Escribe los `n` bytes de `data` en `out`, reintentando las escrituras
+// parciales
+void escribir_buffer(int out, const char* data, size_t n)
+{
+    unsigned long long t0 = stats_reloj();
+    ssize_t w;
+
+    for (size_t off = 0; off < n; off += w)
+    {
+        if ((w = write(out, data + off, n - off)) == -1)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stats_tiempo(&g_stats.ns_write, t0);
+    stats_sumar(&g_stats.bytes_out, n);
+}
+
+
+// Compresión de los trozos de PSPLIT (-z). Cada trozo abierto es un flujo
+// gzip del que se encarga uno de los hilos compresores (se reparten por
+// turno). Lo que se escribe en el trozo se copia a piezas que se encolan, en
+// orden, en la cola de su hilo; el hilo las comprime y escribe el resultado.
+// El hilo principal sólo copia, así que la división sigue limitada por la
+// E/S. La memoria de las piezas en cola está acotada: si se llena, el hilo
+// principal espera a los compresores.
+
+// Estado de un trozo comprimido
+struct trozo_gz {
+    int fd;
+    int cola;           // Hilo que lo comprime
+    z_stream zs;
+};
+
+// Datos pendientes de comprimir de un trozo
+struct pieza {
+    struct trozo_gz* trozo;
+    char* data;
+    size_t len;
+    int fin;            // Última pieza: se cierra el flujo y el fichero
+    struct pieza* next;
+};
+
+// Cola de piezas de un hilo compresor
+struct cola_gz {
+    struct pieza* head;
+    struct pieza* tail;
+};
+
+static struct {
+    pid_t pid;                  // Proceso dueño de los hilos (0 si no hay)
+    int nhilos;
+    pthread_t* hilos;
+    struct cola_gz* colas;
+    pthread_mutex_t mutex;
+    pthread_cond_t trabajo;     // Hay piezas nuevas o hay que terminar
+    pthread_cond_t sitio;       // Se ha liberado memoria de piezas
+    size_t encolado;            // Bytes en piezas aún sin comprimir
+    int terminar;
+    unsigned turno;             // Hilo al que le toca el siguiente trozo
+    struct trozo_gz** trozos;   // Trozo abierto en cada descriptor
+    int ntrozos;
+} g_comp;
+
+
+// Comprime la pieza `p` en `out` (COMP_BUFSIZE bytes) y escribe el
+// resultado. Con la última pieza del trozo cierra el flujo y el fichero.
+void comprimir_pieza(struct pieza* p, unsigned char* out)
+{
+    z_stream* zs = &p->trozo->zs;
+
+    zs->next_in = (unsigned char*) p->data;
+    zs->avail_in = p->len;
+    do {
+        zs->next_out = out;
+        zs->avail_out = COMP_BUFSIZE;
+        if (deflate(zs, p->fin ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR)
+        {
+            error("psplit: deflate: %s\n", zs->msg ? zs->msg : "error");
+            exit(EXIT_FAILURE);
+        }
+        escribir_buffer(p->trozo->fd, (char*) out, COMP_BUFSIZE - zs->avail_out);
+    } while (zs->avail_out == 0);
+
+    if (p->fin)
+    {
+        deflateEnd(zs);
+        cerrar_fichero(p->trozo->fd);
+        free(p->trozo);
+    }
+}
+
+
+// Hilo compresor: atiende su cola hasta que se le pide terminar y está vacía
+void* compresor(void* arg)
+{
+    struct cola_gz* c = arg;
+    struct pieza* p;
+    unsigned char* out;
+
+    if ((out = malloc(COMP_BUFSIZE)) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&g_comp.mutex);
+        while (c->head == NULL && !g_comp.terminar)
+            pthread_cond_wait(&g_comp.trabajo, &g_comp.mutex);
+        if ((p = c->head) == NULL)
+        {
+            pthread_mutex_unlock(&g_comp.mutex);
+            break;
+        }
+        if ((c->head = p->next) == NULL)
+            c->tail = NULL;
+        pthread_mutex_unlock(&g_comp.mutex);
+
+        comprimir_pieza(p, out);
+
+        pthread_mutex_lock(&g_comp.mutex);
+        g_comp.encolado -= p->len;
+        pthread_cond_signal(&g_comp.sitio);
+        pthread_mutex_unlock(&g_comp.mutex);
+
+        free(p->data);
+        free(p);
+    }
+
+    free(out);
+    return NULL;
+}
+
+
+// Arranca los hilos compresores de este proceso. Los procesos hijos de
+// PSPLIT no heredan los hilos del padre y arrancan los suyos.
+void iniciar_compresion()
+{
+    sigset_t all, old;
+
+    memset(&g_comp, 0, sizeof(g_comp));
+    g_comp.pid = getpid();
+    g_comp.nhilos = g_psplit.comp_threads;
+    g_comp.hilos = malloc(g_comp.nhilos * sizeof(pthread_t));
+    g_comp.colas = calloc(g_comp.nhilos, sizeof(struct cola_gz));
+    if (g_comp.hilos == NULL || g_comp.colas == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&g_comp.mutex, NULL);
+    pthread_cond_init(&g_comp.trabajo, NULL);
+    pthread_cond_init(&g_comp.sitio, NULL);
+
+    // Las señales las sigue atendiendo el hilo principal
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < g_comp.nhilos; i++)
+    {
+        if ((errno = pthread_create(&g_comp.hilos[i], NULL, compresor,
+                        &g_comp.colas[i])) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+// Espera a que los hilos compresores acaben con los trozos pendientes
+void terminar_compresion()
+{
+    if (g_comp.pid != getpid())
+        return;
+
+    pthread_mutex_lock(&g_comp.mutex);
+    g_comp.terminar = 1;
+    pthread_cond_broadcast(&g_comp.trabajo);
+    pthread_mutex_unlock(&g_comp.mutex);
+
+    for (int i = 0; i < g_comp.nhilos; i++)
+        pthread_join(g_comp.hilos[i], NULL);
+
+    pthread_cond_destroy(&g_comp.sitio);
+    pthread_cond_destroy(&g_comp.trabajo);
+    pthread_mutex_destroy(&g_comp.mutex);
+    free(g_comp.hilos);
+    free(g_comp.colas);
+    free(g_comp.trozos);
+    memset(&g_comp, 0, sizeof(g_comp));
+}
+
+
+// Encola `len` bytes de `data` (copiados) para el trozo `t`
+void encolar_pieza(struct trozo_gz* t, const char* data, size_t len, int fin)
+{
+    struct pieza* p = malloc(sizeof(struct pieza));
+    struct cola_gz* c = &g_comp.colas[t->cola];
+
+    if (p == NULL || (p->data = len > 0 ? malloc(len) : NULL, len > 0 && p->data == NULL))
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (len > 0)
+        memcpy(p->data, data, len);
+    p->trozo = t;
+    p->len = len;
+    p->fin = fin;
+    p->next = NULL;
+
+    pthread_mutex_lock(&g_comp.mutex);
+    while (g_comp.encolado > 0 &&
+            g_comp.encolado + len > (size_t) g_comp.nhilos * COMP_PIEZAS_HILO * COMP_PIEZA)
+        pthread_cond_wait(&g_comp.sitio, &g_comp.mutex);
+    g_comp.encolado += len;
+    if (c->tail)
+        c->tail->next = p;
+    else
+        c->head = p;
+    c->tail = p;
+    pthread_cond_broadcast(&g_comp.trabajo);
+    pthread_mutex_unlock(&g_comp.mutex);
+}
+
+
+// Empieza el flujo gzip del trozo recién abierto en `fd`
+void comp_abrir(int fd)
+{
+    struct trozo_gz* t;
+
+    if (g_comp.pid != getpid())
+        iniciar_compresion();
+
+    if (fd >= g_comp.ntrozos)
+    {
+        int n = fd + 1 > 2 * g_comp.ntrozos ? fd + 1 : 2 * g_comp.ntrozos;
+        if ((g_comp.trozos = realloc(g_comp.trozos, n * sizeof(*g_comp.trozos))) == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        g_comp.ntrozos = n;
+    }
+
+    if ((t = calloc(1, sizeof(struct trozo_gz))) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    t->fd = fd;
+    t->cola = g_comp.turno++ % g_comp.nhilos;
+    // 15 + 16: ventana de 32 KiB con cabecera gzip
+    if (deflateInit2(&t->zs, g_psplit.comp_level, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        error("psplit: deflateInit2\n");
+        exit(EXIT_FAILURE);
+    }
+    g_comp.trozos[fd] = t;
+}
+
+
+// Encola para comprimir los `n` bytes de `data` del trozo abierto en `fd`,
+// en piezas de hasta COMP_PIEZA bytes
+void comp_escribir(int fd, const char* data, size_t n)
+{
+    for (size_t off = 0, len; off < n; off += len)
+    {
+        len = n - off < COMP_PIEZA ? n - off : COMP_PIEZA;
+        encolar_pieza(g_comp.trozos[fd], data + off, len, 0);
+    }
+}
+
+
+// Cierra el trozo abierto en `fd`: su hilo termina el flujo y el fichero
+void comp_cerrar(int fd)
+{
+    struct trozo_gz* t = g_comp.trozos[fd];
+
+    g_comp.trozos[fd] = NULL;
+    encolar_pieza(t, NULL, 0, 1);
+}
+
+
+// Escribe en `buf` (de `size` bytes) el nombre del trozo número `id` de
+// `file`: el nombre de la entrada (sin directorios con -o), el número con
+// al menos `ancho` cifras, el sufijo de --suffix y .gz si se comprime. El
+// nombre es relativo a `g_psplit.dirfd`.
+void nombre_chunk(char* buf, size_t size, char* file, int id)
+{
+    char* base = strrchr(file, '/');
+
+    if (g_psplit.dirfd != AT_FDCWD && base != NULL)
+        file = base + 1;
+
+    if (snprintf(buf, size, "%s%0*d%s%s", file, g_psplit.ancho, id, g_psplit.sufijo,
+                g_psplit.comp_level ? ".gz" : "") >= (int) size)
+    {
+        error("psplit: %s%d: Nombre de fichero demasiado largo\n", file, id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Bytes de `fd` desde la posición actual hasta el final, o -1 si no es un
+// fichero regular
+off_t bytes_restantes(int fd)
+{
+    struct stat st;
+    off_t pos;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            (pos = lseek(fd, 0, SEEK_CUR)) == -1)
+        return -1;
+
+    return st.st_size > pos ? st.st_size - pos : 0;
+}
+
+
+// Tamaño del trozo `id` de NBYTES bytes de una entrada de `total` bytes (0
+// si no se conoce)
+off_t tam_trozo(off_t total, int NBYTES, int id)
+{
+    off_t off = (off_t) id * NBYTES;
+
+    if (total < 0 || off >= total)
+        return 0;
+
+    return total - off < NBYTES ? total - off : NBYTES;
+}
+
+
+// Abre (creándolo) el fichero de salida número `id` de `file` en el
+// directorio de salida. Si se conoce el tamaño final `tam` (> 0) y no se
+// comprime, se reserva de una vez con `fallocate`: un fichero que crece a
+// base de escrituras pequeñas acaba fragmentado cuando se crean miles a la
+// vez.
+int abrir_chunk(char* file, int id, off_t tam)
+{
+    char file_name[PATH_MAX];
+    unsigned long long t0 = stats_reloj();
+    int out;
+
+    nombre_chunk(file_name, sizeof(file_name), file, id);
+    if ((out = openat(g_psplit.dirfd, file_name, O_CREAT|O_RDWR|O_TRUNC, S_IRWXU)) < 0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Sin soporte en el sistema de ficheros el trozo crece como siempre
+    if (tam > 0 && !g_psplit.comp_level && fallocate(out, 0, 0, tam) == -1 &&
+            errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        perror("fallocate");
+        exit(EXIT_FAILURE);
+    }
+    stats_tiempo(&g_stats.ns_open, t0);
+    stats_sumar(&g_stats.chunks, 1);
+
+    if (g_psplit.comp_level)
+        comp_abrir(out);
+
+    return out;
+}
+
+
+// Escribe los `n` bytes de `data` en el trozo `out`
+void escribir_chunk(int out, const char* data, size_t n)
+{
+    if (g_psplit.comp_level)
+        comp_escribir(out, data, n);
+    else
+        escribir_buffer(out, data, n);
+}
+
+
+// Cierra el trozo `out`
+void cerrar_chunk(int out)
+{
+    if (g_psplit.comp_level)
+        comp_cerrar(out);
+    else
+        cerrar_fichero(out);
+}
+
+
+// Función complementaria a PSPLIT para la opcion -b: copia por bloques de
+// BSIZE bytes con read/write. Es la ruta para entradas que no admiten
+// `copy_file_range` ni `splice`.
+void escribir_bytes_rw(int fd, char* file, int NBYTES, int BSIZE)
+{
+    struct lector l;
+    char* data; // Data buffer
+
+    int read_from_source    = 0; // Bytes leídos del fichero original
+    int remaining           = 0; // Bytes restantes por escribir en el fichero
+    int total_written       = 0; // Bytes totales escritos del buffer
+    int is_incomplete       = 0; // Flag de fichero incompleto
+    int incomplete_fd       = 0; // Descriptor de fichero incompleto
+    int current_file        = 0; // Descriptor del fichero actual
+    int next_file_id        = 0; // Siguiente número de fichero
+    int bytes_in_buffer     = 0; // Bytes totales en el buffer
+    off_t total = bytes_restantes(fd); // Tamaño de la entrada (-1 si no se sabe)
+
+    lector_abrir(&l, fd, BSIZE, g_psplit.depth);
+
+    // Leer mientras el fichero no esté vacío.
+    while ((read_from_source = lector_siguiente(&l, &data)) != 0)
+    {
+        bytes_in_buffer = read_from_source;
+        //printf("Datos leidos: %d\n", bytes_in_buffer);
+        // Actúa como puntero al buffer de bytes, cada vez que escribamos
+        // bytes del buffer en el fichero, se sumará el número de bytes
+        // escritos a esta variable, por lo que la próxima vez 
+        // empezaremos a escribir en el fichero desde la posición
+        // data + total_written
+        total_written = 0;
+
+        // Si el fichero está incompleto
+        if (is_incomplete)
+        {
+            // Si faltan más bytes por escribir de los que hay en el buffer
+            if (remaining > bytes_in_buffer)
+            {
+                escribir_chunk(current_file, data, bytes_in_buffer);
+                total_written += bytes_in_buffer;
+                remaining -= bytes_in_buffer;
+                bytes_in_buffer = 0;
+            }
+            else
+            {
+                escribir_chunk(current_file, data, remaining);
+                total_written += remaining;
+                cerrar_chunk(current_file);
+
+                is_incomplete = 0;
+                bytes_in_buffer -= remaining;
+                
+            }
+        }
+
+        // Mientras queden bytes en el buffer...
+        while (bytes_in_buffer > 0)
+        {
+            // Abrimos el nuevo fichero
+            current_file = abrir_chunk(file, next_file_id,
+                    tam_trozo(total, NBYTES, next_file_id));
+            next_file_id++;
+
+            // Si el tamaño en bytes del fichero es mayor que los bytes
+            // que tenemos actualmente en el buffer, el fichero quedará
+            // incompleto y todos los bytes del buffer se consumirán
+            if (NBYTES > bytes_in_buffer)
+            {
+                escribir_chunk(current_file, data + total_written, bytes_in_buffer);
+                total_written += bytes_in_buffer;
+                is_incomplete = 1;
+                remaining = NBYTES - bytes_in_buffer;
+                bytes_in_buffer = 0;
+            }
+            else
+            {
+                escribir_chunk(current_file, data + total_written, NBYTES);
+                total_written += NBYTES;
+                cerrar_chunk(current_file);
+
+                bytes_in_buffer -= NBYTES;
+                
+            }
+        }
+    }
+
+    // Último fichero, incompleto
+    if (is_incomplete)
+        cerrar_chunk(current_file);
+
+    lector_cerrar(&l);
+}
+
+
+// Parte por leer de un fichero de entrada regular proyectada en memoria
+struct proyeccion {
+    void* base;     // Dirección devuelta por `mmap`
+    size_t len;     // Bytes proyectados desde `base`
+    char* data;     // Primer byte por leer
+    size_t size;    // Bytes por leer desde `data`
+    off_t offset;   // Posición de `data` en el fichero
+};
+
+
+// `proyectar` proyecta en `p`, con `MADV_SEQUENTIAL`, lo que queda por leer
+// del fichero regular `fd` desde su posición actual. Devuelve 0 si `fd` no es
+// un fichero regular proyectable (tuberías, ttys, ficheros de /proc o /sys que
+// dicen tener tamaño 0...) o si se abrió con O_DIRECT para no pasar por la
+// caché de páginas.
+int proyectar(int fd, struct proyeccion* p)
+{
+    struct stat st;
+    off_t start;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &st) == -1)
+    {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 || es_directa(fd))
+        return 0;
+
+    if ((p->offset = lseek(fd, 0, SEEK_CUR)) == -1)
+    {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(p, 0, offsetof(struct proyeccion, offset));
+    if (p->offset >= st.st_size)
+        return 1;
+
+    // `mmap` exige un desplazamiento múltiplo del tamaño de página
+    start = p->offset & ~(off_t) (page - 1);
+    p->len = st.st_size - start;
+    p->base = mmap(NULL, p->len, PROT_READ, MAP_SHARED, fd, start);
+    if (p->base == MAP_FAILED)
+        return 0;
+    madvise(p->base, p->len, MADV_SEQUENTIAL);
+
+    p->data = (char*) p->base + (p->offset - start);
+    p->size = st.st_size - p->offset;
+    stats_sumar(&g_stats.bytes_in, p->size);
+
+    return 1;
+}
+
+
+// Deshace la proyección `p` y deja `fd` al final, como si se hubiera leído
+void liberar_proyeccion(int fd, struct proyeccion* p)
+{
+    if (p->base && munmap(p->base, p->len) == -1)
+    {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+    if (lseek(fd, p->offset + p->size, SEEK_SET) == -1)
+    {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Copia al fichero `out` los `n` bytes de la proyección `p` que empiezan en
+// `off`. Se usa `copy_file_range`, que no pasa por espacio de usuario (y en
+// XFS o btrfs comparte extents, *reflink*); si el sistema de ficheros no lo
+// admite se activa `*use_write` y se escribe directamente desde la proyección.
+void copiar_rango(int fd, struct proyeccion* p, size_t off, size_t n,
+        int out, int* use_write)
+{
+    loff_t in_off = p->offset + off;
+    ssize_t r;
+
+    while (n > 0 && !*use_write)
+    {
+        unsigned long long t0 = stats_reloj();
+        r = copy_file_range(fd, &in_off, out, NULL, n, 0);
+        stats_tiempo(&g_stats.ns_write, t0);
+        if (r == -1)
+        {
+            if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                    errno != EOPNOTSUPP)
+            {
+                perror("copy_file_range");
+                exit(EXIT_FAILURE);
+            }
+            *use_write = 1;
+            break;
+        }
+        if (r == 0)
+            return;
+        stats_sumar(&g_stats.bytes_out, r);
+        off += r;
+        n -= r;
+    }
+
+    if (n > 0)
+        escribir_chunk(out, p->data + off, n);
+}
+
+
+// Función complementaria a PSPLIT para la opción -b cuando la entrada es un
+// fichero regular proyectado en memoria: escribe los trozos `first` a `last`
+// (sin incluir). Los límites de cada trozo se conocen de antemano y no hace
+// falta buffer de lectura.
+void escribir_bytes_mmap(int fd, struct proyeccion* p, char* file, int NBYTES,
+        size_t first, size_t last)
+{
+    // Los trozos comprimidos no admiten `copy_file_range`
+    int use_write = g_psplit.comp_level != 0;
+
+    for (size_t id = first; id < last; id++)
+    {
+        size_t off = id * NBYTES;
+        size_t n = p->size - off < (size_t) NBYTES ? p->size - off : (size_t) NBYTES;
+        int out = abrir_chunk(file, id, n);
+
+        copiar_rango(fd, p, off, n, out, &use_write);
+        cerrar_chunk(out);
+    }
+}
+
+
+// Número de trozos de NBYTES bytes de la proyección `p`
+size_t num_chunks(struct proyeccion* p, int NBYTES)
+{
+    return (p->size + NBYTES - 1) / NBYTES;
+}
+
+
+// Función complementaria a PSPLIT para la opción -b cuando la entrada es una
+// tubería o un socket: los datos se mueven con `splice` a través de una
+// tubería intermedia sin copiarse a espacio de usuario. Devuelve 0 si la
+// entrada no admite `splice` (y no se ha consumido nada de ella).
+int escribir_bytes_splice(int fd, char* file, int NBYTES)
+{
+    int p[2];
+    int out = -1;
+    int next_file_id = 0;
+    size_t left = NBYTES;   // Bytes que faltan para completar el trozo
+    ssize_t n, w;
+    unsigned long long t0;
+
+    // Los trozos comprimidos pasan por los hilos compresores
+    if (g_psplit.comp_level)
+        return 0;
+
+    if (pipe(p) == -1)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    for (t0 = stats_reloj(); (n = splice(fd, NULL, p[1], NULL, left, SPLICE_F_MOVE)) != 0;
+            t0 = stats_reloj())
+    {
+        stats_tiempo(&g_stats.ns_read, t0);
+        if (n == -1)
+        {
+            if (errno == EINVAL && next_file_id == 0)
+            {
+                close(p[0]);
+                close(p[1]);
+                return 0;
+            }
+            perror("splice");
+            exit(EXIT_FAILURE);
+        }
+
+        // El fichero de salida se crea cuando hay datos para él
+        if (out == -1)
+            out = abrir_chunk(file, next_file_id++, 0);
+
+        stats_sumar(&g_stats.bytes_in, n);
+        t0 = stats_reloj();
+        for (; n > 0; n -= w)
+        {
+            if ((w = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE)) == -1)
+            {
+                perror("splice");
+                exit(EXIT_FAILURE);
+            }
+            stats_sumar(&g_stats.bytes_out, w);
+            left -= w;
+        }
+        stats_tiempo(&g_stats.ns_write, t0);
+
+        if (left == 0)
+        {
+            cerrar_chunk(out);
+            out = -1;
+            left = NBYTES;
+        }
+    }
+
+    if (out != -1)
+        cerrar_chunk(out);
+
+    TRY( close(p[0]) );
+    TRY( close(p[1]) );
+
+    return 1;
+}
+
+
+// Función complementaria a PSPLIT para la opción -l. Localiza en una sola
+// pasada (con `memchr`, vectorizado en glibc) el final de la `nlines`-ésima
+// línea de los `n` bytes de `data`. Devuelve los bytes hasta ese final,
+// incluido el '\n', y en `*found` las líneas encontradas. Si hay menos de
+// `nlines` líneas devuelve `n`.
+size_t localizar_lineas(const char* data, size_t n, int nlines, int* found)
+{
+    const char* p = data;
+    const char* end = data + n;
+    const char* nl;
+    int count = 0;
+
+    while (count < nlines && (nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        p = nl + 1;
+        count++;
+    }
+
+    *found = count;
+    return count == nlines ? (size_t) (p - data) : n;
+}
+
+
+// Función complementaria a PSPLIT para la opción -l cuando la entrada no se
+// puede proyectar en memoria: lee bloques de BSIZE bytes.
+void escribir_lineas_rw(int fd, char* file, int NLINES, int BSIZE) 
+{
+    struct lector l;
+    char* data; // Data buffer
+
+    ssize_t read_from_source;       // Bytes leídos del fichero original
+    int remaining       = NLINES;   // Lineas restantes por escribir en el fichero
+    int current_file    = -1;       // Descriptor del fichero actual
+    int next_file_id    = 0;        // Siguiente número de fichero
+
+    lector_abrir(&l, fd, BSIZE, g_psplit.depth);
+
+    // Leer mientras el fichero no esté vacío.
+    while ((read_from_source = lector_siguiente(&l, &data)) != 0)
+    {
+        // Reparte el buffer entre el fichero actual y los siguientes
+        size_t total_written = 0;
+        while (total_written < (size_t) read_from_source)
+        {
+            int found;
+            size_t n = localizar_lineas(data + total_written,
+                    read_from_source - total_written, remaining, &found);
+
+            if (current_file == -1)
+                current_file = abrir_chunk(file, next_file_id++, 0);
+
+            escribir_chunk(current_file, data + total_written, n);
+            total_written += n;
+            remaining -= found;
+
+            // Fichero completo
+            if (remaining == 0)
+            {
+                cerrar_chunk(current_file);
+                current_file = -1;
+                remaining = NLINES;
+            }
+        }
+    }
+
+    if (current_file != -1)
+        cerrar_chunk(current_file);
+
+    lector_cerrar(&l);
+}
+
+
+// Función complementaria a PSPLIT para la opción -l cuando la entrada es un
+// fichero regular proyectado en memoria: escribe los trozos que empiezan en
+// [`start`, `end`), siendo `start` el comienzo del trozo `first_id`. Cada
+// trozo se localiza y se escribe directamente desde la proyección, sin
+// arrastrar líneas entre bloques; el último puede acabar después de `end`.
+void escribir_lineas_mmap(struct proyeccion* p, char* file, int NLINES,
+        size_t start, size_t end, int first_id)
+{
+    int next_file_id = first_id;
+    int found;
+
+    for (size_t off = start, n; off < end; off += n)
+    {
+        n = localizar_lineas(p->data + off, p->size - off, NLINES, &found);
+
+        int out = abrir_chunk(file, next_file_id++, n);
+        escribir_chunk(out, p->data + off, n);
+        cerrar_chunk(out);
+    }
+}
+
+
+// Motor io_uring de PSPLIT. La entrada se lee por bloques de BSIZE bytes con
+// dos buffers: mientras se escriben los trozos de un bloque ya está en vuelo
+// la lectura del siguiente. Cada trozo de salida es una cadena enlazada
+// (IOSQE_IO_LINK) OPENAT → [FALLOCATE] → WRITE → [FSYNC] → CLOSE sobre un
+// hueco de la tabla de ficheros registrados, de modo que los open/write/close
+// de muchos trozos pequeños viajan juntos en una sola llamada a
+// `io_uring_enter`.
+
+// `user_data` de la lectura de la entrada
+#define URING_LEER UINT64_MAX
+// `user_data` de la reserva de un trozo, que puede fallar sin romper la cadena
+#define URING_RESERVAR (UINT64_MAX - 1)
+
+struct uring {
+    int fd;
+    unsigned entries;                   // Entradas de la cola de envío
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    unsigned queued;                    // SQEs preparadas sin enviar
+    unsigned pending;                   // SQEs enviadas sin completar
+    ssize_t leidos;                     // Resultado de la última lectura
+};
+
+
+// Libera el anillo
+void uring_exit(struct uring* r)
+{
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    TRY( close(r->fd) );
+}
+
+
+// Crea el anillo y registra URING_SLOTS huecos vacíos para ficheros. Devuelve
+// 0 si el núcleo no ofrece io_uring (o lo tiene deshabilitado).
+int uring_init(struct uring* r)
+{
+    struct io_uring_params par;
+    struct io_uring_rsrc_register files;
+    unsigned* array;
+
+    memset(r, 0, sizeof(*r));
+    memset(&par, 0, sizeof(par));
+    if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &par)) == -1)
+        return 0;
+
+    r->entries = par.sq_entries;
+    r->sq_len = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+    r->cq_len = par.cq_off.cqes + par.cq_entries * sizeof(struct io_uring_cqe);
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, par.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    r->sq_head = (unsigned*) ((char*) r->sq_ptr + par.sq_off.head);
+    r->sq_tail = (unsigned*) ((char*) r->sq_ptr + par.sq_off.tail);
+    r->sq_mask = (unsigned*) ((char*) r->sq_ptr + par.sq_off.ring_mask);
+    r->cq_head = (unsigned*) ((char*) r->cq_ptr + par.cq_off.head);
+    r->cq_tail = (unsigned*) ((char*) r->cq_ptr + par.cq_off.tail);
+    r->cq_mask = (unsigned*) ((char*) r->cq_ptr + par.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) ((char*) r->cq_ptr + par.cq_off.cqes);
+
+    // La entrada i del array apunta siempre a la SQE i
+    array = (unsigned*) ((char*) r->sq_ptr + par.sq_off.array);
+    for (unsigned i = 0; i < par.sq_entries; i++)
+        array[i] = i;
+
+    // Tabla dispersa de ficheros: OPENAT los instala directamente en un hueco
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_SLOTS;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES2,
+                &files, sizeof(files)) == -1)
+    {
+        uring_exit(r);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+// Devuelve una SQE vacía al final de la cola de envío. Quien llama se
+// asegura de que hay sitio (`uring_libres`).
+struct io_uring_sqe* uring_sqe(struct uring* r)
+{
+    unsigned tail = *r->sq_tail;
+    struct io_uring_sqe* sqe = &r->sqes[tail & *r->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+
+    return sqe;
+}
+
+
+// SQEs que aún caben antes de tener que vaciar la cola
+unsigned uring_libres(struct uring* r)
+{
+    return r->entries - r->queued - r->pending;
+}
+
+
+// Envía las SQEs preparadas y espera a que se completen todas las
+// operaciones en vuelo. Cualquier error de E/S es fatal, como en las rutas
+// síncronas.
+void uring_vaciar(struct uring* r)
+{
+    while (r->queued > 0 || r->pending > 0)
+    {
+        unsigned long long t0 = stats_reloj();
+        int ret = syscall(__NR_io_uring_enter, r->fd, r->queued,
+                r->queued + r->pending, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_tiempo(&g_stats.ns_uring, t0);
+
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        r->queued -= ret;
+        r->pending += ret;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++, r->pending--)
+        {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+
+            // Sin `fallocate` en el sistema de ficheros el trozo se
+            // escribe sin reservar
+            if (cqe->user_data == URING_RESERVAR &&
+                    (cqe->res == -EOPNOTSUPP || cqe->res == -ENOSYS))
+                continue;
+            if (cqe->res < 0)
+            {
+                error("psplit: io_uring: %s\n", strerror(-cqe->res));
+                exit(EXIT_FAILURE);
+            }
+            if (cqe->user_data == URING_LEER)
+            {
+                r->leidos = cqe->res;
+                stats_sumar(&g_stats.bytes_in, cqe->res);
+            }
+            // Las escrituras llevan en `user_data` los bytes esperados
+            else if (cqe->user_data != 0 && cqe->user_data != URING_RESERVAR)
+            {
+                if ((__u64) cqe->res != cqe->user_data)
+                {
+                    error("psplit: io_uring: Escritura incompleta (%d de %llu bytes)\n",
+                            cqe->res, (unsigned long long) cqe->user_data);
+                    exit(EXIT_FAILURE);
+                }
+                stats_sumar(&g_stats.bytes_out, cqe->res);
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+
+// Encola la lectura del siguiente bloque de `fd` desde `pos` (-1: desde la
+// posición actual, para tuberías y otras entradas sin desplazamiento)
+void uring_leer(struct uring* r, int fd, char* buf, int BSIZE, off_t pos)
+{
+    struct io_uring_sqe* sqe = uring_sqe(r);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (__u64) (uintptr_t) buf;
+    sqe->len = BSIZE;
+    sqe->off = (__u64) pos;
+    sqe->user_data = URING_LEER;
+}
+
+
+// Cierra el trozo abierto en `slot`, forzándolo antes a disco según --sync.
+// La cadena sigue a la última escritura del trozo.
+void uring_cerrar(struct uring* r, int slot)
+{
+    struct io_uring_sqe* sqe;
+
+    if (g_psplit.sync == SYNC_FILE || g_psplit.sync == SYNC_RANGE)
+    {
+        sqe = uring_sqe(r);
+        if (g_psplit.sync == SYNC_FILE)
+            sqe->opcode = IORING_OP_FSYNC;
+        else
+        {
+            // Inicia la escritura de todo el fichero sin esperar a que acabe
+            sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+            sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+        }
+        sqe->fd = slot;
+        sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_LINK;
+    }
+
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+}
+
+
+// Función complementaria a PSPLIT para -b (NLINES == 0) y -l con el motor
+// io_uring. Devuelve 0 si io_uring no está disponible y no se ha consumido
+// nada de la entrada.
+int escribir_uring(int fd, char* file, int NBYTES, int NLINES, int BSIZE)
+{
+    struct uring r;
+    struct io_uring_sqe* sqe;
+    size_t name_len = strlen(file) + strlen(g_psplit.sufijo) + g_psplit.ancho + 16;
+    char* names;            // Nombre del trozo abierto en cada hueco
+    char* buf[2];           // Bloque actual y bloque en lectura
+    int cur = 0;
+    ssize_t n;
+    off_t pos;              // Desplazamiento del siguiente bloque (-1 si no hay)
+    off_t total = NLINES ? -1 : bytes_restantes(fd);   // Tamaño de la entrada
+
+    int next_file_id = 0;   // Siguiente número de fichero
+    int slot = -1;          // Hueco del trozo abierto (-1 si no hay ninguno)
+    __u64 written = 0;      // Bytes escritos en el trozo abierto
+    int left = NLINES ? NLINES : NBYTES;   // Líneas o bytes que le faltan
+    int opened = 0;         // Trozos abiertos desde el último vaciado
+
+    // Los trozos comprimidos pasan por los hilos compresores
+    if (g_psplit.comp_level || !uring_init(&r))
+        return 0;
+
+    if ((names = malloc(URING_SLOTS * name_len)) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    buf[0] = reservar_buffers(2 * (size_t) BSIZE);
+    buf[1] = buf[0] + BSIZE;
+
+    // Los desplazamientos se llevan aquí: con O_DIRECT el núcleo no siempre
+    // avanza la posición del fichero en las lecturas sin desplazamiento
+    pos = lseek(fd, 0, SEEK_CUR);
+
+    uring_leer(&r, fd, buf[cur], BSIZE, pos);
+    uring_vaciar(&r);
+
+    while ((n = r.leidos) > 0)
+    {
+        if (pos != -1)
+            pos += n;
+
+        // La lectura del siguiente bloque queda en vuelo mientras se
+        // escribe el actual
+        uring_leer(&r, fd, buf[1 - cur], BSIZE, pos);
+
+        for (size_t off = 0, len; off < (size_t) n; off += len)
+        {
+            int found = 0;
+            char* data = buf[cur] + off;
+
+            // Un trozo nuevo no puede reutilizar el hueco de otro cuya
+            // cadena aún no se ha completado
+            if (uring_libres(&r) < 5 || (slot == -1 && opened == URING_SLOTS - 1))
+            {
+                uring_vaciar(&r);
+                opened = 0;
+            }
+
+            if (slot == -1)
+            {
+                off_t tam = tam_trozo(total, NBYTES, next_file_id);
+
+                slot = next_file_id % URING_SLOTS;
+                char* name = names + slot * name_len;
+                nombre_chunk(name, name_len, file, next_file_id++);
+
+                sqe = uring_sqe(&r);
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = g_psplit.dirfd;
+                sqe->addr = (__u64) (uintptr_t) name;
+                sqe->open_flags = O_CREAT|O_RDWR|O_TRUNC;
+                sqe->len = S_IRWXU;
+                sqe->file_index = slot + 1;
+                sqe->flags = IOSQE_IO_LINK;
+                written = 0;
+                opened++;
+                stats_sumar(&g_stats.chunks, 1);
+
+                // Como en `abrir_chunk`, el trozo se reserva entero si se
+                // conoce su tamaño
+                if (tam > 0)
+                {
+                    sqe = uring_sqe(&r);
+                    sqe->opcode = IORING_OP_FALLOCATE;
+                    sqe->fd = slot;
+                    sqe->off = 0;
+                    sqe->addr = tam;
+                    sqe->len = 0;
+                    sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK;
+                    sqe->user_data = URING_RESERVAR;
+                }
+            }
+
+            if (NLINES)
+            {
+                len = localizar_lineas(data, n - off, left, &found);
+                left -= found;
+            }
+            else
+            {
+                len = (size_t) left < n - off ? (size_t) left : n - off;
+                left -= len;
+            }
+
+            sqe = uring_sqe(&r);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = slot;
+            sqe->addr = (__u64) (uintptr_t) data;
+            sqe->len = len;
+            sqe->off = written;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->user_data = len;
+            written += len;
+
+            // Trozo completo: se fuerza a disco según --sync y se cierra
+            if (left == 0)
+            {
+                sqe->flags |= IOSQE_IO_LINK;
+                uring_cerrar(&r, slot);
+
+                slot = -1;
+                left = NLINES ? NLINES : NBYTES;
+            }
+        }
+
+        // El buffer actual se reutiliza cuando acaban sus escrituras
+        uring_vaciar(&r);
+        opened = 0;
+        cur = 1 - cur;
+    }
+
+    // Último trozo incompleto
+    if (slot != -1)
+    {
+        uring_cerrar(&r, slot);
+        uring_vaciar(&r);
+    }
+
+    // La entrada queda al final, como si se hubiera leído con `read`
+    if (pos != -1 && lseek(fd, pos, SEEK_SET) == -1)
+    {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+
+    free(names);
+    uring_exit(&r);
+
+    return 1;
+}
+
+
+// Función complementaria a PSPLIT para la opcion -b. Elige la forma de copia
+// más barata que admite la entrada.
+void escribir_bytes(int fd, char* file, int NBYTES, int BSIZE)
+{
+    struct proyeccion p;
+
+    if (g_psplit.io == IO_URING && escribir_uring(fd, file, NBYTES, 0, BSIZE))
+        return;
+
+    // Con -q el anillo de lectura sustituye a las demás rutas
+    if (g_psplit.depth > 1)
+        escribir_bytes_rw(fd, file, NBYTES, BSIZE);
+    else if (proyectar(fd, &p))
+    {
+        escribir_bytes_mmap(fd, &p, file, NBYTES, 0, num_chunks(&p, NBYTES));
+        liberar_proyeccion(fd, &p);
+    }
+    else if ((es_directa(fd) || !escribir_bytes_splice(fd, file, NBYTES)) &&
+            (g_psplit.io == IO_SYNC || !escribir_uring(fd, file, NBYTES, 0, BSIZE)))
+        escribir_bytes_rw(fd, file, NBYTES, BSIZE);
+}
+
+
+// Función complementaria a PSPLIT para la opción -C. Devuelve la longitud
+// del trozo que empieza en `data`, con `n` bytes disponibles: hasta el
+// último separador de registro de sus NBYTES primeros bytes (buscado hacia
+// atrás con `memrchr`, vectorizado en glibc), o NBYTES si el registro no
+// cabe entero. Con `fin`, lo disponible es el final de la entrada y el
+// último trozo se queda con lo que queda.
+size_t medir_registros(const char* data, size_t n, int NBYTES, int fin)
+{
+    const char* d;
+
+    if (fin && n <= (size_t) NBYTES)
+        return n;
+
+    d = memrchr(data, g_psplit.rdelim, NBYTES);
+    return d ? (size_t) (d + 1 - data) : (size_t) NBYTES;
+}
+
+
+// Función complementaria a PSPLIT para la opción -C cuando la entrada es un
+// fichero regular proyectado en memoria: cada trozo se mide en la
+// proyección y se copia con `copy_file_range`
+void escribir_registros_mmap(int fd, struct proyeccion* p, char* file, int NBYTES)
+{
+    // Los trozos comprimidos no admiten `copy_file_range`
+    int use_write = g_psplit.comp_level != 0;
+    int next_file_id = 0;
+
+    for (size_t off = 0, n; off < p->size; off += n)
+    {
+        n = medir_registros(p->data + off, p->size - off, NBYTES, 1);
+
+        int out = abrir_chunk(file, next_file_id++, n);
+        copiar_rango(fd, p, off, n, out, &use_write);
+        cerrar_chunk(out);
+    }
+}
+
+
+// Función complementaria a PSPLIT para la opción -C cuando la entrada no se
+// puede proyectar: se llena un buffer de NBYTES bytes con lecturas de hasta
+// BSIZE bytes, se escribe el trozo y lo que sobra (el comienzo del registro
+// siguiente) se mueve al principio del buffer
+void escribir_registros_rw(int fd, char* file, int NBYTES, int BSIZE)
+{
+    char* buf = reservar_buffers(NBYTES);
+    size_t len = 0;         // Bytes en el buffer
+    ssize_t r = 1;          // Resultado de la última lectura (0: final)
+    int next_file_id = 0;
+
+    for (;;)
+    {
+        while (len < (size_t) NBYTES && r != 0)
+        {
+            size_t want = NBYTES - len < (size_t) BSIZE ? NBYTES - len : (size_t) BSIZE;
+
+            unsigned long long t0 = stats_reloj();
+            if ((r = read(fd, buf + len, want)) == -1)
+            {
+                perror("read");
+                exit(EXIT_FAILURE);
+            }
+            stats_tiempo(&g_stats.ns_read, t0);
+            stats_sumar(&g_stats.bytes_in, r);
+            len += r;
+        }
+        if (len == 0)
+            break;
+
+        size_t n = medir_registros(buf, len, NBYTES, r == 0);
+        int out = abrir_chunk(file, next_file_id++, n);
+
+        escribir_chunk(out, buf, n);
+        cerrar_chunk(out);
+
+        memmove(buf, buf + n, len - n);
+        len -= n;
+    }
+}
+
+
+// Función complementaria a PSPLIT para la opción -C: trozos de como mucho
+// NBYTES bytes que acaban en un separador de registro
+void escribir_registros(int fd, char* file, int NBYTES, int BSIZE)
+{
+    struct proyeccion p;
+
+    if (proyectar(fd, &p))
+    {
+        escribir_registros_mmap(fd, &p, file, NBYTES);
+        liberar_proyeccion(fd, &p);
+    }
+    else
+        escribir_registros_rw(fd, file, NBYTES, BSIZE);
+}
+
+
+// Función complementaria a PSPLIT para la opción -l
+void escribir_lineas(int fd, char* file, int NLINES, int BSIZE)
+{
+    struct proyeccion p;
+
+    if (g_psplit.io == IO_URING && escribir_uring(fd, file, 0, NLINES, BSIZE))
+        return;
+
+    if (g_psplit.depth > 1)
+        escribir_lineas_rw(fd, file, NLINES, BSIZE);
+    else if (proyectar(fd, &p))
+    {
+        escribir_lineas_mmap(&p, file, NLINES, 0, p.size, 0);
+        liberar_proyeccion(fd, &p);
+    }
+    else if (g_psplit.io == IO_SYNC || !escribir_uring(fd, file, 0, NLINES, BSIZE))
+        escribir_lineas_rw(fd, file, NLINES, BSIZE);
+}
+
+
+// Salida con buffer de PSPLIT para los modos que escriben línea a línea
+// (-k y -r): agrupa las líneas en bloques de SALIDA_BUFSIZE bytes para no
+// hacer una llamada a `write` por línea
+struct salida {
+    int fd;         // Descriptor del fichero (-1 si no está abierto)
+    size_t len;     // Bytes pendientes en `buf`
+    char* buf;
+};
+
+
+// Abre el fichero de salida número `id` de `file` en `s`
+void salida_abrir(struct salida* s, char* file, int id)
+{
+    s->fd = abrir_chunk(file, id, 0);
+    s->len = 0;
+    if (s->buf == NULL && (s->buf = malloc(SALIDA_BUFSIZE)) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Añade los `n` bytes de `data` a la salida `s`
+void salida_escribir(struct salida* s, const char* data, size_t n)
+{
+    if (s->len + n > SALIDA_BUFSIZE)
+    {
+        escribir_chunk(s->fd, s->buf, s->len);
+        s->len = 0;
+
+        // Lo que no cabe en el buffer se escribe directamente
+        if (n >= SALIDA_BUFSIZE)
+        {
+            escribir_chunk(s->fd, data, n);
+            return;
+        }
+    }
+
+    memcpy(s->buf + s->len, data, n);
+    s->len += n;
+}
+
+
+// Vacía el buffer de la salida `s` y cierra su fichero
+void salida_cerrar(struct salida* s)
+{
+    escribir_chunk(s->fd, s->buf, s->len);
+    cerrar_chunk(s->fd);
+    s->fd = -1;
+    s->len = 0;
+}
+
+
+// Añade `n` bytes de `data` a la línea arrastrada `*buf`, haciéndola crecer
+void arrastrar(char** buf, size_t* len, size_t* cap, const char* data, size_t n)
+{
+    if (*len + n > *cap)
+    {
+        *cap = *len + n > 2 * *cap ? *len + n : 2 * *cap;
+        if ((*buf = realloc(*buf, *cap)) == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+
+// Función complementaria a PSPLIT para los modos por registro (-k y -r):
+// recorre la entrada por bloques de BSIZE bytes (con el lector de -q) y
+// entrega a `procesar` cada línea completa, incluido su '\n', sin copiarla.
+// Sólo la línea que queda a medias al final de un bloque se copia para
+// completarla con el principio del siguiente.
+void recorrer_lineas(int fd, int BSIZE,
+        void (*procesar)(const char* line, size_t len, void* ctx), void* ctx)
+{
+    struct lector l;
+    char* data;
+    ssize_t n;
+    char* carry = NULL;     // Línea arrastrada del bloque anterior
+    size_t carry_len = 0;
+    size_t carry_cap = 0;
+
+    lector_abrir(&l, fd, BSIZE, g_psplit.depth);
+
+    while ((n = lector_siguiente(&l, &data)) != 0)
+    {
+        const char* p = data;
+        const char* end = data + n;
+        const char* nl;
+
+        if (carry_len > 0)
+        {
+            nl = memchr(p, '\n', end - p);
+            const char* q = nl ? nl + 1 : end;
+
+            arrastrar(&carry, &carry_len, &carry_cap, p, q - p);
+            p = q;
+            if (nl == NULL)
+                continue;
+            procesar(carry, carry_len, ctx);
+            carry_len = 0;
+        }
+
+        while ((nl = memchr(p, '\n', end - p)) != NULL)
+        {
+            procesar(p, nl + 1 - p, ctx);
+            p = nl + 1;
+        }
+
+        if (p < end)
+            arrastrar(&carry, &carry_len, &carry_cap, p, end - p);
+    }
+
+    // Última línea sin '\n'
+    if (carry_len > 0)
+        procesar(carry, carry_len, ctx);
+
+    free(carry);
+    lector_cerrar(&l);
+}
+
+
+// Función hash FNV-1a de los `n` bytes de `s`
+static unsigned hash_clave(const char* s, size_t n)
+{
+    unsigned h = 2166136261u;
+
+    while (n-- > 0)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+
+    return h;
+}
+
+
+// Envía `line` a la partición que corresponde al hash de su campo -k. Si la
+// línea no tiene tantos campos la clave es la cadena vacía.
+void procesar_clave(const char* line, size_t len, void* ctx)
+{
+    struct salida* out = ctx;
+    const char* end = line + len - (len > 0 && line[len - 1] == '\n');
+    const char* key = line;
+    const char* d;
+
+    for (int f = 1; f < g_psplit.key_field; f++)
+    {
+        if ((d = memchr(key, g_psplit.delim, end - key)) == NULL)
+        {
+            key = end;
+            break;
+        }
+        key = d + 1;
+    }
+    d = memchr(key, g_psplit.delim, end - key);
+
+    salida_escribir(&out[hash_clave(key, (d ? d : end) - key) % g_psplit.nparts],
+            line, len);
+}
+
+
+// Función complementaria a PSPLIT para la opción -k: reparte las líneas
+// entre NPARTS ficheros según el hash de un campo, de modo que todas las
+// líneas con la misma clave acaban en el mismo fichero
+void escribir_claves(int fd, char* file, int BSIZE)
+{
+    struct salida out[g_psplit.nparts];
+
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < g_psplit.nparts; i++)
+        salida_abrir(&out[i], file, i);
+
+    recorrer_lineas(fd, BSIZE, procesar_clave, out);
+
+    for (int i = 0; i < g_psplit.nparts; i++)
+    {
+        salida_cerrar(&out[i]);
+        free(out[i].buf);
+    }
+}
+
+
+// Trozos del modo -r
+struct cortes {
+    struct salida out;  // Trozo actual
+    char* file;         // Prefijo de los ficheros de salida
+    int next_file_id;   // Siguiente número de fichero
+};
+
+
+// Empieza un trozo nuevo si `line` encaja con el patrón -r. La comparación
+// se hace sobre la propia línea (sin el '\n') gracias a REG_STARTEND.
+void procesar_patron(const char* line, size_t len, void* ctx)
+{
+    struct cortes* c = ctx;
+    regmatch_t m;
+
+    m.rm_so = 0;
+    m.rm_eo = len - (len > 0 && line[len - 1] == '\n');
+
+    if (c->out.fd != -1 && regexec(&g_psplit.regex, line, 1, &m, REG_STARTEND) == 0)
+        salida_cerrar(&c->out);
+
+    if (c->out.fd == -1)
+        salida_abrir(&c->out, c->file, c->next_file_id++);
+
+    salida_escribir(&c->out, line, len);
+}
+
+
+// Función complementaria a PSPLIT para la opción -r: cada línea que encaja
+// con el patrón empieza un fichero nuevo
+void escribir_patron(int fd, char* file, int BSIZE)
+{
+    struct cortes c;
+
+    memset(&c, 0, sizeof(c));
+    c.out.fd = -1;
+    c.file = file;
+
+    recorrer_lineas(fd, BSIZE, procesar_patron, &c);
+
+    if (c.out.fd != -1)
+        salida_cerrar(&c.out);
+    free(c.out.buf);
+}
+
+
+// Divide la entrada `fd` según el modo elegido (-k, -C, -r, -l o -b)
+void dividir_entrada(int fd, char* file, int NBYTES, int NLINES, int BSIZE)
+{
+    if (g_psplit.key_field != 0) escribir_claves(fd, file, BSIZE);
+    else if (g_psplit.alinear) escribir_registros(fd, file, NBYTES, BSIZE);
+    else if (g_psplit.patron) escribir_patron(fd, file, BSIZE);
+    else if (NBYTES != 1024) escribir_bytes(fd, file, NBYTES, BSIZE);
+    else if (NLINES != 0) escribir_lineas(fd, file, NLINES, BSIZE);
+    else escribir_bytes(fd, file, NBYTES, BSIZE);
+}
+
+
+// Espera a los `n` procesos de `pids` (con SIGCHLD ya bloqueada) en el orden
+// en que terminan. Con -v, tras cada uno se vacía la tubería de estadísticas
+// en `w`: si no, con cientos de procesos la tubería se llena, los hijos se
+// bloquean en `write` y el padre en `waitpid`.
+void esperar_trabajadores(pid_t* pids, int n, struct psplit_stats* w)
+{
+    int quedan = n;
+    int status;
+    pid_t pid;
+
+    while (quedan > 0)
+    {
+        if ((pid = waitpid(-1, &status, 0)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
+            exit(EXIT_FAILURE);
+        }
+
+        int k;
+        for (k = 0; k < n; k++)
+            if (pids[k] == pid) break;
+
+        if (k < n)
+        {
+            pids[k] = 0;
+            quedan--;
+            stats_recoger(NULL, &g_stats, w);
+        }
+        else
+            // Era una tarea en segundo plano del shell
+            deletejob(pid);
+    }
+}
+
+
+// `psplit_paralelo` reparte un único fichero de entrada entre PROCS procesos.
+// El resultado es idéntico al de la versión secuencial:
+//
+// - Con -b, cada proceso escribe un rango consecutivo de trozos; el número de
+//   cada fichero de salida se calcula a partir de su desplazamiento.
+//
+// - Con -l, el fichero se divide en PROCS rangos que acaban en '\n'. Una
+//   primera pasada en paralelo cuenta las líneas de cada rango y, con las
+//   sumas acumuladas, cada proceso sabe cuántas líneas le preceden: salta
+//   hasta el comienzo del primer trozo que empieza en su rango y escribe los
+//   trozos que empiezan en él.
+//
+// Devuelve 0 si la entrada no se puede proyectar en memoria.
+int psplit_paralelo(int fd, char* file, int NBYTES, int NLINES, int PROCS)
+{
+    struct proyeccion p;
+    struct psplit_stats w[PROCS];   // Contadores de cada proceso (-v)
+    unsigned long long t0;
+    int workers = PROCS;
+
+    if (!proyectar(fd, &p))
+        return 0;
+
+    memset(w, 0, sizeof(w));
+    t0 = stats_reloj();
+
+    fflush(NULL);
+    block_sigchld();
+
+    if (NLINES == 0)
+    {
+        size_t chunks = num_chunks(&p, NBYTES);
+        pid_t pids[PROCS];
+
+        if ((size_t) workers > chunks)
+            workers = chunks;
+
+        for (int k = 0; k < workers; k++)
+        {
+            if ((pids[k] = fork_or_panic("fork psplit")) == 0)
+            {
+                unsigned long long t = stats_empezar();
+
+                escribir_bytes_mmap(fd, &p, file, NBYTES,
+                        chunks * k / workers, chunks * (k + 1) / workers);
+                terminar_compresion();
+                stats_enviar(-1, k, t);
+                exit(EXIT_SUCCESS);
+            }
+        }
+        esperar_trabajadores(pids, workers, w);
+    }
+    else
+    {
+        size_t bounds[PROCS + 1];   // Rangos [bounds[k], bounds[k+1])
+        long long lines[PROCS];     // Líneas de cada rango
+        pid_t pids[PROCS];
+        int found;
+        int pc[2];
+
+        // Ajusta los límites al siguiente fin de línea
+        bounds[0] = 0;
+        for (int k = 1; k < PROCS; k++)
+        {
+            size_t b = p.size * k / PROCS;
+            char* nl;
+
+            if (b < bounds[k - 1])
+                b = bounds[k - 1];
+            if (b > 0 && (nl = memchr(p.data + b - 1, '\n', p.size - b + 1)) != NULL)
+                b = nl - p.data + 1;
+            else if (b > 0)
+                b = p.size;
+            bounds[k] = b;
+        }
+        bounds[PROCS] = p.size;
+
+        // Primera pasada: cada proceso cuenta las líneas de su rango
+        if (pipe(pc) == -1)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < PROCS; k++)
+        {
+            if ((pids[k] = fork_or_panic("fork psplit")) == 0)
+            {
+                long long msg[2] = { k, 0 };
+                char* q = p.data + bounds[k];
+                char* end = p.data + bounds[k + 1];
+
+                while (q < end && (q = memchr(q, '\n', end - q)) != NULL)
+                {
+                    msg[1]++;
+                    q++;
+                }
+                // Escritura atómica: sizeof(msg) < PIPE_BUF
+                if (write(pc[1], msg, sizeof(msg)) != sizeof(msg))
+                {
+                    perror("write");
+                    exit(EXIT_FAILURE);
+                }
+                exit(EXIT_SUCCESS);
+            }
+        }
+        TRY( close(pc[1]) );
+        for (int k = 0; k < PROCS; k++)
+        {
+            long long msg[2];
+            if (read(pc[0], msg, sizeof(msg)) != sizeof(msg))
+            {
+                error("psplit: no se pudo contar las líneas\n");
+                exit(EXIT_FAILURE);
+            }
+            lines[msg[0]] = msg[1];
+        }
+        TRY( close(pc[0]) );
+        esperar_trabajadores(pids, PROCS, w);
+
+        // Segunda pasada: cada proceso escribe los trozos que empiezan en su
+        // rango
+        long long before = 0;   // Líneas anteriores al rango k
+        for (int k = 0; k < PROCS; k++)
+        {
+            if ((pids[k] = fork_or_panic("fork psplit")) == 0)
+            {
+                unsigned long long t = stats_empezar();
+                long long id = (before + NLINES - 1) / NLINES;
+                size_t start = bounds[k] + localizar_lineas(p.data + bounds[k],
+                        p.size - bounds[k], (int) (id * NLINES - before), &found);
+
+                escribir_lineas_mmap(&p, file, NLINES, start, bounds[k + 1], id);
+                terminar_compresion();
+                stats_enviar(-1, k, t);
+                exit(EXIT_SUCCESS);
+            }
+            before += lines[k];
+        }
+        esperar_trabajadores(pids, PROCS, w);
+    }
+
+    unblock_sigchld();
+    liberar_proyeccion(fd, &p);
+
+    // Los contadores de los procesos se suman a los de la entrada
+    if (g_psplit.stats)
+    {
+        stats_recoger(NULL, &g_stats, w);
+        stats_procesos(w, workers, stats_reloj() - t0);
+    }
+
+    return 1;
+}
+
+
+// Termina las estadísticas de la entrada `name`, que empezó en `t0`: espera a
+// sus compresores para que cuenten todo lo escrito, imprime sus contadores,
+// los suma a `total` y los pone a cero para la siguiente
+void stats_entrada(const char* name, unsigned long long t0, struct psplit_stats* total)
+{
+    if (!g_psplit.stats)
+        return;
+
+    terminar_compresion();
+    g_stats.ns_wall = stats_reloj() - t0;
+    stats_imprimir(name, &g_stats);
+    stats_acumular(total, &g_stats);
+    memset(&g_stats, 0, sizeof(g_stats));
+}
+
+
+// Con --sync=end, fuerza a disco con `syncfs` los sistemas de ficheros donde
+// se han creado los ficheros de salida de `names` (el directorio actual para
+// stdin, o el de -o), una sola vez por dispositivo
+void sincronizar_salidas(char** names, int n)
+{
+    char dir[PATH_MAX];
+    dev_t devs[n > 0 ? n : 1];
+    int ndevs = 0;
+    struct stat st;
+    int fd, k;
+
+    if (g_psplit.dirfd != AT_FDCWD)
+    {
+        if (syncfs(g_psplit.dirfd) == -1)
+        {
+            perror("syncfs");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    for (int i = 0; i < (n > 0 ? n : 1); i++)
+    {
+        if (n > 0 && strlen(names[i]) < sizeof(dir))
+            strcpy(dir, names[i]);
+        else
+            strcpy(dir, ".");
+
+        if ((fd = open(dirname(dir), O_RDONLY|O_DIRECTORY)) == -1)
+        {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+        TRY( fstat(fd, &st) );
+
+        for (k = 0; k < ndevs && devs[k] != st.st_dev; k++);
+        if (k == ndevs)
+        {
+            devs[ndevs++] = st.st_dev;
+            if (syncfs(fd) == -1)
+            {
+                perror("syncfs");
+                exit(EXIT_FAILURE);
+            }
+        }
+        TRY( close(fd) );
+    }
+}
+
+
+// Divide el fichero `name` según el modo elegido
+void psplit_fichero(char* name, int NBYTES, int NLINES, int BSIZE)
+{
+    int fd = abrir_entrada(name);
+
+    dividir_entrada(fd, name, NBYTES, NLINES, BSIZE);
+
+    if ( close(fd) == -1 )
+    {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// Comando PSPLIT
+void run_psplit(struct execcmd* ecmd)
+{
+    int opt;
+    optind = 1;
+
+    /* Tamaño máximo del buffer */
+    static int MAX_BSIZE = 64 << 20;
+    /* Profundidad máxima del anillo de lectura */
+    static int MAX_QDEPTH = 64;
+    /* Número máximo de particiones de -k */
+    static int MAX_NPARTS = 1024;
+    /* Número máximo de cifras del número de fichero */
+    static int MAX_ANCHO = 32;
+    /* Número máximo de procesos de -p (dimensiona vectores en la pila) */
+    static int MAX_PROCS = 1024;
+
+    /* Valores por defecto */
+    int NLINES  = 0;
+    int BSIZE   = 1024;
+    int PROCS   = 1;
+    int NBYTES  = 1024;
+    int SYNC, IO;
+    g_psplit.sync = SYNC_FILE;
+    g_psplit.io = IO_AUTO;
+    g_psplit.depth = 1;
+    g_psplit.direct = 0;
+    g_psplit.key_field = 0;
+    g_psplit.delim = '\t';
+    g_psplit.nparts = 8;
+    g_psplit.comp_level = 0;
+    g_psplit.alinear = 0;
+    g_psplit.rdelim = '\n';
+    g_psplit.dirfd = AT_FDCWD;
+    g_psplit.ancho = 1;
+    g_psplit.sufijo = "";
+    g_psplit.stats = 0;
+    char* REGEX = NULL;
+    char* DIR = NULL;
+
+    static const struct option long_opts[] = {
+        {"sync", required_argument, NULL, 'S'},
+        {"io", required_argument, NULL, 'I'},
+        {"direct", no_argument, NULL, 'D'},
+        {"suffix", required_argument, NULL, 'X'},
+        {"stats", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+    
+    while ((opt = getopt_long(ecmd->argc, ecmd->argv, "l:b:C:d:s:p:q:k:t:n:r:z:o:a:vh", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'l': { NLINES = atoi(optarg); break; }
+            case 'b': { NBYTES = atoi(optarg); break; }
+            case 'C': { NBYTES = atoi(optarg); g_psplit.alinear = 1; break; }
+            case 's': { BSIZE  = atoi(optarg); break; }
+            case 'p': { PROCS  = atoi(optarg); break; }
+            case 'q': { g_psplit.depth = atoi(optarg); break; }
+            case 'k':
+                // 0 significa «sin -k»: un campo no válido se marca con -1
+                g_psplit.key_field = atoi(optarg);
+                if (g_psplit.key_field < 1)
+                    g_psplit.key_field = -1;
+                break;
+            case 'n': { g_psplit.nparts = atoi(optarg); break; }
+            case 'r': { REGEX = optarg; break; }
+            case 'z': { g_psplit.comp_level = atoi(optarg); break; }
+            case 'o': { DIR = optarg; break; }
+            case 'a': { g_psplit.ancho = atoi(optarg); break; }
+            case 'v': { g_psplit.stats = 1; break; }
+            case 'X':
+                // El sufijo va tras el número: no puede cambiar de directorio
+                if (strchr(optarg, '/') != NULL)
+                {
+                    printf("%s: Opción --suffix no válida\n", ecmd->argv[0]);
+                    return;
+                }
+                g_psplit.sufijo = optarg;
+                break;
+            case 't':
+            case 'd':
+                {
+                    // Un carácter, o `\t` para el tabulador
+                    char* c = opt == 't' ? &g_psplit.delim : &g_psplit.rdelim;
+
+                    if (strcmp(optarg, "\\t") == 0)
+                        *c = '\t';
+                    else if (strlen(optarg) == 1)
+                        *c = optarg[0];
+                    else
+                    {
+                        printf("%s: Opción -%c no válida\n", ecmd->argv[0], opt);
+                        return;
+                    }
+                    break;
+                }
+            case 'S':
+                for (SYNC = SYNC_RANGE; SYNC >= 0; SYNC--)
+                    if (strcmp(optarg, PSPLIT_SYNC_NAMES[SYNC]) == 0) break;
+                if (SYNC < 0)
+                {
+                    printf("%s: Opción --sync no válida\n", ecmd->argv[0]);
+                    return;
+                }
+                g_psplit.sync = SYNC;
+                break;
+            case 'D': { g_psplit.direct = 1; break; }
+            case 'I':
+                for (IO = IO_SYNC; IO >= 0; IO--)
+                    if (strcmp(optarg, PSPLIT_IO_NAMES[IO]) == 0) break;
+                if (IO < 0)
+                {
+                    printf("%s: Opción --io no válida\n", ecmd->argv[0]);
+                    return;
+                }
+                g_psplit.io = IO;
+                break;
+            case 'h':
+                printf("Uso: %s [-l NLINES] [-b NBYTES] [-C NBYTES [-d DELIM]] [-s BSIZE] [-p PROCS] [-q QDEPTH] [-k FIELD [-t DELIM] [-n NPARTS]] [-r REGEX] [-z LEVEL] [-o DIR] [-a WIDTH] [--suffix=SUF] [-v] [--sync=MODO] [--io=MOTOR] [--direct] [FILE1] [FILE2]...\n", ecmd->argv[0]);
+                printf("     Opciones:\n");
+                printf("     -l NLINES Número máximo de líneas por fichero.\n");
+                printf("     -b NBYTES Número máximo de bytes por fichero.\n");
+                printf("     -C NBYTES Como -b, pero cada fichero acaba en un separador de\n");
+                printf("               registro (salvo registros de más de NBYTES bytes).\n");
+                printf("     -d DELIM  Separador de registros de -C (por defecto, '\\n').\n");
+                printf("     -k FIELD  Reparte las líneas entre NPARTS ficheros según el hash del\n");
+                printf("               campo FIELD (desde 1).\n");
+                printf("     -t DELIM  Separador de campos de -k (por defecto, tabulador).\n");
+                printf("     -n NPARTS Número de ficheros de -k (por defecto, 8).\n");
+                printf("     -r REGEX  Empieza un fichero nuevo en cada línea que encaja con la\n");
+                printf("               expresión regular extendida REGEX.\n");
+                printf("     -s BSIZE  Tamaño en bytes de los bloques leídos de stdin o de entradas\n");
+                printf("               que no son ficheros regulares.\n");
+                printf("     -p PROCS  Número máximo de procesos simultáneos (hasta 1024).\n");
+                printf("     -z LEVEL  Comprime cada fichero con gzip (nivel 1-9, sufijo .gz) en\n");
+                printf("               hilos aparte.\n");
+                printf("     -o DIR    Crea los ficheros en el directorio DIR, con el nombre de la\n");
+                printf("               entrada sin sus directorios.\n");
+                printf("     -a WIDTH  Número mínimo de cifras del número de fichero, con ceros a\n");
+                printf("               la izquierda (por defecto, 1).\n");
+                printf("     --suffix=SUF Sufijo tras el número de fichero (antes de .gz).\n");
+                printf("     -v, --stats Muestra, por fichero y en total, los bytes leídos y\n");
+                printf("               escritos, los trozos, los MB/s y el tiempo en read, write,\n");
+                printf("               fsync y open; con -p, también el uso de cada proceso.\n");
+                printf("     -q QDEPTH Buffers de BSIZE bytes que un hilo lector mantiene llenos\n");
+                printf("               mientras se escriben los anteriores (1: sin hilo lector).\n");
+                printf("     --sync=MODO Durabilidad de los ficheros creados: none (ninguna),\n");
+                printf("               file (fsync de cada fichero, por defecto), end (un syncfs\n");
+                printf("               al terminar) o range (sync_file_range asíncrono).\n");
+                printf("     --io=MOTOR E/S de los ficheros divididos secuencialmente: auto\n");
+                printf("               (io_uring sólo en lugar de read/write, por defecto), uring\n");
+                printf("               (io_uring para toda entrada) o sync (nunca io_uring). Sin\n");
+                printf("               io_uring en el núcleo se usan las llamadas síncronas.\n");
+                printf("     --direct  Lee los ficheros con O_DIRECT, sin pasar por la caché de\n");
+                printf("               páginas (BSIZE debe ser múltiplo del tamaño de página).\n");
+                printf("     -h        Ayuda\n\n");
+                return;
+
+            default:
+                printf("Uso: %s [-l NLINES] [-b NBYTES] [-C NBYTES [-d DELIM]] [-s BSIZE] [-p PROCS] [-q QDEPTH] [-k FIELD [-t DELIM] [-n NPARTS]] [-r REGEX] [-z LEVEL] [-o DIR] [-a WIDTH] [--suffix=SUF] [-v] [--sync=MODO] [--io=MOTOR] [--direct] [FILE1] [FILE2]...\n", ecmd->argv[0]);
+                return;
+        }   
+    }
+
+    if ((NLINES != 0) + (NBYTES != 1024 || g_psplit.alinear) + (g_psplit.key_field != 0) +
+            (REGEX != NULL) > 1 || (g_psplit.alinear && g_psplit.direct))
+    {
+        printf("%s: Opciones incompatibles\n", ecmd->argv[0]);
+        return;
+    }
+
+    if (NBYTES < 1)
+    {
+        printf("%s: Opción -%c no válida\n", ecmd->argv[0], g_psplit.alinear ? 'C' : 'b');
+        return;
+    }
+
+    if (NLINES < 0)
+    {
+        printf("%s: Opción -l no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    if (g_psplit.key_field < 0)
+    {
+        printf("%s: Opción -k no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    if (g_psplit.nparts < 1 || g_psplit.nparts > MAX_NPARTS)
+    {
+        printf("%s: Opción -n no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    if (g_psplit.comp_level < 0 || g_psplit.comp_level > 9)
+    {
+        printf("%s: Opción -z no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    if (BSIZE < 1 || BSIZE > MAX_BSIZE)
+    {
+        printf("%s: Opción -s no válida\n", ecmd->argv[0]);
+        return;   
+    }
+
+    if (PROCS < 1 || PROCS > MAX_PROCS)
+    {
+        printf("%s: Opción -p no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    if (g_psplit.ancho < 1 || g_psplit.ancho > MAX_ANCHO)
+    {
+        printf("%s: Opción -a no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    // Los procesos de -p se reparten las CPU para comprimir
+    g_psplit.comp_threads = sysconf(_SC_NPROCESSORS_ONLN) / PROCS;
+    if (g_psplit.comp_threads < 1)
+        g_psplit.comp_threads = 1;
+
+    if (g_psplit.depth < 1 || g_psplit.depth > MAX_QDEPTH)
+    {
+        printf("%s: Opción -q no válida\n", ecmd->argv[0]);
+        return;
+    }
+
+    // O_DIRECT exige buffers, tamaños y desplazamientos alineados
+    if (g_psplit.direct && BSIZE % sysconf(_SC_PAGESIZE) != 0)
+    {
+        printf("%s: Con --direct, BSIZE debe ser múltiplo de %ld\n",
+                ecmd->argv[0], sysconf(_SC_PAGESIZE));
+        return;
+    }
+
+    g_psplit.patron = REGEX != NULL;
+    if (g_psplit.patron)
+    {
+        int err = regcomp(&g_psplit.regex, REGEX, REG_EXTENDED|REG_NOSUB);
+        if (err != 0)
+        {
+            char msg[128];
+            regerror(err, &g_psplit.regex, msg, sizeof(msg));
+            printf("%s: Opción -r no válida: %s\n", ecmd->argv[0], msg);
+            return;
+        }
+    }
+
+    // Los trozos se crean con `openat` relativo al directorio de salida, sin
+    // volver a resolver su ruta en cada fichero
+    if (DIR != NULL && (g_psplit.dirfd = open(DIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+    {
+        printf("%s: %s: %s\n", ecmd->argv[0], DIR, strerror(errno));
+        if (g_psplit.patron)
+            regfree(&g_psplit.regex);
+        return;
+    }
+
+    /*
+     * fork(psplit(f1); fork(psplit(f2)); ... ; fork(psplit(fn)))
+     * Hay PROCS huecos. Al principio se lanza un hijo por hueco y, en
+     * cuanto termina cualquiera de ellos (waitpid(-1)), su hueco se
+     * rellena con el siguiente fichero pendiente. Así ningún hueco queda
+     * ocioso esperando a un hijo concreto.
+     *
+     * Si no quedan más ficheros se siguen recogiendo los procesos en
+     * vuelo hasta que terminan todos.
+     */
+
+    int num_files = ecmd->argc - optind;
+    char* file_names[num_files];
+
+    /* Almacenar nombre de los ficheros. */
+    for (int i = optind, index = 0; i < ecmd->argc; i++, index++)
+        file_names[index] = ecmd->argv[i];
+
+    // Estadísticas (-v): los hijos de -p mandan sus contadores al padre por
+    // una tubería
+    struct psplit_stats total;
+    unsigned long long t0 = stats_reloj();
+
+    memset(&total, 0, sizeof(total));
+    memset(&g_stats, 0, sizeof(g_stats));
+    if (g_psplit.stats && PROCS > 1)
+    {
+        if (pipe2(g_stats_pipe, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            exit(EXIT_FAILURE);
+        }
+        TRY( fcntl(g_stats_pipe[0], F_SETFL, O_NONBLOCK) );
+    }
+
+    // Si no hay ficheros, leer de la entrada estándar
+    if (num_files == 0)
+    {
+        dividir_entrada(STDIN_FILENO, "stdin", NBYTES, NLINES, BSIZE);
+        stats_entrada("stdin", t0, &total);
+    }
+    // Un único fichero: se reparte el propio fichero entre los procesos
+    else if (num_files == 1 && PROCS > 1 &&
+            g_psplit.key_field == 0 && !g_psplit.patron && !g_psplit.alinear)
+    {
+        int fd = abrir_entrada(file_names[0]);
+
+        if (!psplit_paralelo(fd, file_names[0], NBYTES,
+                    NBYTES == 1024 ? NLINES : 0, PROCS))
+            dividir_entrada(fd, file_names[0], NBYTES, NLINES, BSIZE);
+
+        if ( close(fd) == -1 )
+        {
+            perror("close");
+            exit(EXIT_FAILURE);
+        }
+        stats_entrada(file_names[0], t0, &total);
     }
     else if (PROCS > 1)
     {
-        block_sigchld();
-        int num_children = 0;       /* Contador de hijos creados */
+        pid_t running_pids[PROCS];  /* PIDs de los procesos en cada hueco */
+        struct psplit_stats w[PROCS];   /* Contadores de cada hueco (-v) */
         int procesos_en_vuelo = 0;  /* Número de procesos corriendo al mismo tiempo */
-        int running_pids[PROCS];    /* PIDs de los procesos ejecutándose */
-        int oldest_pid = 0;             /* */
+        int next_file = 0;          /* Siguiente fichero por repartir */
         int status;
-        int procesos_terminados = 0;
-        
-        for(int i = 0; i < PROCS; i++) running_pids[i] = 0;
+        pid_t pid;
+
+        for (int i = 0; i < PROCS; i++) running_pids[i] = 0;
+        memset(w, 0, sizeof(w));
+
+        fflush(NULL);
+        block_sigchld();
+
+        while (next_file < num_files || procesos_en_vuelo > 0)
+        {
+            // Rellenar todos los huecos libres con ficheros pendientes
+            for (int i = 0; i < PROCS && next_file < num_files; i++)
+            {
+                if (running_pids[i])
+                    continue;
+
+                if ((pid = fork_or_panic("fork psplit")) == 0)
+                {
+                    unsigned long long t = stats_empezar();
+
+                    psplit_fichero(file_names[next_file], NBYTES, NLINES, BSIZE);
+                    terminar_compresion();
+                    stats_enviar(next_file, i, t);
+                    exit(EXIT_SUCCESS);
+                }
+                running_pids[i] = pid;
+                procesos_en_vuelo++;
+                next_file++;
+            }
+
+            // Esperar a cualquier hijo: su hueco se rellena en la siguiente
+            // vuelta
+            if ((pid = waitpid(-1, &status, 0)) == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("waitpid");
+                exit(EXIT_FAILURE);
+            }
+
+            int slot;
+            for (slot = 0; slot < PROCS; slot++)
+                if (running_pids[slot] == pid) break;
+
+            if (slot < PROCS)
+            {
+                running_pids[slot] = 0;
+                procesos_en_vuelo--;
+                stats_recoger(file_names, &total, w);
+            }
+            else
+                // Era una tarea en segundo plano del shell
+                deletejob(pid);
+        }
+
+        unblock_sigchld();
+        if (g_psplit.stats)
+            stats_procesos(w, PROCS, stats_reloj() - t0);
+    }
+    else
+    {
+        for (int i = 0; i < num_files; i++)
+        {
+            unsigned long long t = stats_reloj();
+
+            psplit_fichero(file_names[i], NBYTES, NLINES, BSIZE);
+            stats_entrada(file_names[i], t, &total);
+        }
+    }
+
+    terminar_compresion();
+
+    if (g_psplit.sync == SYNC_END)
+    {
+        unsigned long long t = stats_reloj();
+
+        sincronizar_salidas(file_names, num_files);
+        stats_tiempo(&total.ns_sync, t);
+    }
+
+    if (g_psplit.stats)
+    {
+        total.ns_wall = stats_reloj() - t0;
+        stats_imprimir("total", &total);
+    }
+    if (g_stats_pipe[0] != -1)
+    {
+        TRY( close(g_stats_pipe[0]) );
+        TRY( close(g_stats_pipe[1]) );
+        g_stats_pipe[0] = g_stats_pipe[1] = -1;
+    }
+
+    liberar_buffers();
+    if (g_psplit.patron)
+        regfree(&g_psplit.regex);
+    if (g_psplit.dirfd != AT_FDCWD)
+        TRY( close(g_psplit.dirfd) );
+}
+
+
+// Comando BJOBS
+void run_bjobs(struct execcmd* ecmd)
+{
+    int opt;
+    optind = 1;
+
+    while ((opt = getopt(ecmd->argc, ecmd->argv, "kh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'k':
+                // Matamos a todos los procesos en segundo plano
+                for(int i = 0; i<NUM_BG_PIDS; i++){
+                if(BG_PIDS[i])
+                    if ( kill(BG_PIDS[i], SIGKILL) == -1)
+                    {
+                        perror("kill");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                return;
+            case 'h':
+                printf("Uso: %s [-k] [-h]\n", ecmd->argv[0]);
+                printf("     Opciones:\n");
+                printf("     -k Mata todos los procesos en segundo plano.\n");
+                printf("     -h Ayuda\n");
+                return;
+
+            default:
+                return;
+        }   
+    }   
+
+    // Mostramos los procesos que estan en segundo plano
+    for(int i = 0; i<NUM_BG_PIDS; i++){
+        if(BG_PIDS[i])
+            printf("[%d]\n", BG_PIDS[i]);
+    }
+
+}
+
+
+// Comando HASH
+void run_hash(struct execcmd* ecmd)
+{
+    struct hash_entry* e;
+    int opt;
+    int reset = 0;
+    optind = 1;
+
+    while ((opt = getopt(ecmd->argc, ecmd->argv, "rh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': { reset = 1; break; }
+            case 'h':
+                printf("Uso: %s [-r] [-h]\n", ecmd->argv[0]);
+                printf("     Opciones:\n");
+                printf("     -r Vacía la tabla de rutas de comandos.\n");
+                printf("     -h Ayuda\n");
+                return;
+
+            default:
+                return;
+        }
+    }
+
+    // Olvidamos todas las rutas recordadas
+    if (reset)
+    {
+        hash_clear();
+        g_hash_hits = g_hash_misses = 0;
+        return;
+    }
+
+    // Mostramos las rutas recordadas y sus usos
+    printf("usos\tcomando\n");
+    for (int i = 0; i < HASH_BUCKETS; i++)
+        for (e = g_hash[i]; e; e = e->next)
+            printf("%4d\t%s\n", e->hits, e->path);
+    printf("aciertos: %d, fallos: %d\n", g_hash_hits, g_hash_misses);
+}
+
+
+void run_internal_cmd(struct execcmd* ecmd) 
+{
+	if (strcmp(ecmd->argv[0], "cwd") == 0)       run_cwd();
+	else if (strcmp(ecmd->argv[0], "exit") == 0) run_exit();
+	else if (strcmp(ecmd->argv[0], "cd") == 0)
+	{
+	    if (ecmd->argc > 2) printf("run_cd: Demasiados argumentos\n");
+	    else run_cd(ecmd->argv[1]);
+	}
+    else if (strcmp(ecmd->argv[0], "psplit") == 0) run_psplit(ecmd);
+    else if (strcmp(ecmd->argv[0], "bjobs") == 0) run_bjobs(ecmd);
+    else if (strcmp(ecmd->argv[0], "hash") == 0) run_hash(ecmd);
+}
+
+
+/******************************************************************************
+ * Medida de tiempos con `time`
+ ******************************************************************************/
+
+
+// Mientras se ejecuta una orden `TIME`, cada hijo que el shell espera
+// (comando, etapa de una tubería, bloque) se recoge con `wait4` y su
+// consumo de recursos se apunta en `g_time`. Los hijos de otros hijos
+// no se apuntan por separado: `wait4` ya los suma a los de su padre.
+
+struct time_etapa {
+    const char* nombre;     // NULL si el hijo no llegó a lanzarse
+    int orden;              // Número de la orden dentro de la línea medida
+    int etapa;              // Posición en su tubería (0 si no es una etapa)
+    double real;
+    struct rusage ru;
+    int status;
+};
+
+struct time_registro {
+    int activo;
+    int n;
+    int max;
+    int ordenes;            // Órdenes apuntadas hasta ahora
+    struct time_etapa* etapas;
+};
+
+static struct time_registro g_time;
+
+
+// Segundos entre `t0` y `t1`
+static double time_real(const struct timespec* t0, const struct timespec* t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+
+static double time_seg(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+// Instante de lanzamiento de un hijo (sólo si hay un `time` en curso)
+void time_lanzar(struct timespec* t0)
+{
+    if (g_time.activo)
+        clock_gettime(CLOCK_MONOTONIC, t0);
+}
+
+
+// Nombre con el que se muestra `cmd` en el informe de `time`
+const char* time_nombre(struct cmd* cmd)
+{
+    while (cmd->type == REDR)
+        cmd = ((struct redrcmd*) cmd)->cmd;
+
+    switch (cmd->type)
+    {
+        case EXEC:
+            return ((struct execcmd*) cmd)->argv[0] ? ((struct execcmd*) cmd)->argv[0] : "-";
+        case SUBS:
+            return "( )";
+        case PIPE:
+            return "|";
+        case LIST:
+            return ";";
+        default:
+            return "?";
+    }
+}
+
+
+// Reserva en `g_time` los registros de una orden de `n` etapas (1 si no es
+// una tubería) y devuelve el índice del primero. Los registros quedan en el
+// orden de las etapas aunque éstas se recojan en otro.
+int time_reservar(int n)
+{
+    struct time_etapa* e;
+    int base = g_time.n;
+
+    while (g_time.n + n > g_time.max)
+    {
+        g_time.max = g_time.max ? 2 * g_time.max : 8;
+        if ((e = realloc(g_time.etapas, g_time.max * sizeof(*e))) == NULL)
+        {
+            perror("time: realloc");
+            exit(EXIT_FAILURE);
+        }
+        g_time.etapas = e;
+    }
+
+    g_time.ordenes++;
+    for (int i = 0; i < n; i++)
+    {
+        e = &g_time.etapas[base + i];
+        e->nombre = NULL;
+        e->orden = g_time.ordenes;
+        e->etapa = n > 1 ? i + 1 : 0;
+    }
+    g_time.n += n;
+
+    return base;
+}
+
+
+// Apunta en el registro `i` de `g_time` un hijo lanzado en `t0` y recién
+// recogido
+void time_apuntar(int i, const char* nombre, const struct timespec* t0,
+        const struct rusage* ru, int status)
+{
+    struct time_etapa* e = &g_time.etapas[i];
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    e->nombre = nombre;
+    e->real = time_real(t0, &t1);
+    e->ru = *ru;
+    e->status = status;
+}
+
+
+// Espera al hijo `pid` de la orden `cmd`, lanzado en `t0`. Con un `time` en
+// curso usa `wait4` y apunta el hijo; si no, es un `waitpid` normal.
+void esperar_hijo(pid_t pid, int* status, struct cmd* cmd, const struct timespec* t0)
+{
+    struct rusage ru;
+
+    if (!g_time.activo)
+    {
+        TRY( waitpid(pid, status, 0) );
+        return;
+    }
+
+    TRY( wait4(pid, status, 0, &ru) );
+    time_apuntar(time_reservar(1), time_nombre(cmd), t0, &ru, *status);
+}
+
+
+// Espera a las `n` etapas de una tubería en el orden en que terminan, para
+// que el tiempo real de cada una sea el suyo y no el de la más lenta de las
+// anteriores. Entre una pasada y otra se duerme en `sigwaitinfo`, con
+// SIGCHLD enmascarada para que quede pendiente en vez de descartarse.
+void esperar_etapas(struct pipecmd* pcmd, pid_t* pids, const struct timespec* t0)
+{
+    sigset_t chld, prev;
+    struct rusage ru;
+    int base = time_reservar(pcmd->ncmds);
+    int quedan = 0;
+    pid_t pid;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+
+    for (int i = 0; i < pcmd->ncmds; i++)
+        quedan += pids[i] > 0;
+
+    sigprocmask(SIG_BLOCK, &chld, &prev);
+    while (quedan > 0)
+    {
+        for (int i = 0; i < pcmd->ncmds; i++)
+        {
+            if (pids[i] <= 0)
+                continue;
+            TRY( pid = wait4(pids[i], &pcmd->status[i], WNOHANG, &ru) );
+            if (pid == 0)
+                continue;
+            time_apuntar(base + i, time_nombre(pcmd->cmds[i]), &t0[i], &ru,
+                    pcmd->status[i]);
+            pids[i] = 0;
+            quedan--;
+        }
+        if (quedan > 0 && sigwaitinfo(&chld, NULL) < 0 && errno != EINTR)
+        {
+            perror("sigwaitinfo");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+
+// Imprime una línea del informe de `time` por stderr
+static void time_imprimir(const char* etiqueta, double real, const struct rusage* ru)
+{
+    fprintf(stderr, "time: %s: real %.3f s, user %.3f s, sys %.3f s, maxrss %ld KiB, "
+            "ctxsw %ld vol/%ld invol, bloques %ld in/%ld out\n",
+            etiqueta, real, time_seg(ru->ru_utime), time_seg(ru->ru_stime),
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_inblock, ru->ru_oublock);
+}
+
+
+// Suma a `tot` la diferencia `b - a` de CPU, cambios de contexto y bloques
+static void time_sumar(struct rusage* tot, const struct rusage* a, const struct rusage* b)
+{
+    struct timeval d;
+
+    timersub(&b->ru_utime, &a->ru_utime, &d);
+    timeradd(&tot->ru_utime, &d, &tot->ru_utime);
+    timersub(&b->ru_stime, &a->ru_stime, &d);
+    timeradd(&tot->ru_stime, &d, &tot->ru_stime);
+    tot->ru_nvcsw += b->ru_nvcsw - a->ru_nvcsw;
+    tot->ru_nivcsw += b->ru_nivcsw - a->ru_nivcsw;
+    tot->ru_inblock += b->ru_inblock - a->ru_inblock;
+    tot->ru_oublock += b->ru_oublock - a->ru_oublock;
+}
+
+
+// `run_time` ejecuta la orden de `tcmd` y muestra, por stderr, una línea por
+// cada hijo esperado (con su estado de salida) y una línea con el total. Cada
+// hijo se identifica por su número de orden dentro de la línea (`2`) y, si es
+// una etapa de una tubería, por su posición en ella (`2.3`). El total incluye
+// lo que consume el propio shell (comandos internos como `psplit`) y todos
+// sus hijos recogidos mientras tanto; su `maxrss` es el mayor de los hijos o,
+// si no hubo ninguno, el del shell. Los `time` anidados (p.ej. dentro de un
+// bloque) tienen su propio registro.
+void run_time(struct timecmd* tcmd)
+{
+    struct time_registro prev = g_time;
+    struct rusage self0, self1, hijos0, hijos1, tot;
+    struct timespec t0, t1;
+    struct time_etapa* e;
+    char etiqueta[64];
+    int n;
+
+    memset(&g_time, 0, sizeof(g_time));
+    g_time.activo = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    TRY( getrusage(RUSAGE_SELF, &self0) );
+    TRY( getrusage(RUSAGE_CHILDREN, &hijos0) );
+
+    run_cmd(tcmd->cmd);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    TRY( getrusage(RUSAGE_SELF, &self1) );
+    TRY( getrusage(RUSAGE_CHILDREN, &hijos1) );
+
+    memset(&tot, 0, sizeof(tot));
+    time_sumar(&tot, &self0, &self1);
+    time_sumar(&tot, &hijos0, &hijos1);
+    tot.ru_maxrss = g_time.n ? 0 : self1.ru_maxrss;
+
+    for (int i = 0; i < g_time.n; i++)
+    {
+        e = &g_time.etapas[i];
+        if (e->nombre == NULL)
+            continue;
+
+        // Orden N o etapa N.K de una tubería
+        if (e->etapa)
+            n = snprintf(etiqueta, sizeof(etiqueta), "%d.%d", e->orden, e->etapa);
+        else
+            n = snprintf(etiqueta, sizeof(etiqueta), "%d", e->orden);
+        if (WIFSIGNALED(e->status))
+            snprintf(etiqueta + n, sizeof(etiqueta) - n, " (%.20s, señal %d)",
+                    e->nombre, WTERMSIG(e->status));
+        else
+            snprintf(etiqueta + n, sizeof(etiqueta) - n, " (%.20s, estado %d)",
+                    e->nombre, WEXITSTATUS(e->status));
+        time_imprimir(etiqueta, e->real, &e->ru);
+        if (e->ru.ru_maxrss > tot.ru_maxrss)
+            tot.ru_maxrss = e->ru.ru_maxrss;
+    }
+    time_imprimir("total", time_real(&t0, &t1), &tot);
+
+    free(g_time.etapas);
+    g_time = prev;
+}
+
+
+/******************************************************************************
+ * Funciones para la ejecución de la línea de órdenes
+ ******************************************************************************/
+
+
+void exec_cmd(struct execcmd* ecmd)
+{
+    assert(ecmd->type == EXEC);
+
+    if (ecmd->argv[0] == NULL) exit(EXIT_SUCCESS);
+
+    execvp(ecmd->argv[0], ecmd->argv);
+
+    panic("no se encontró el comando '%s'\n", ecmd->argv[0]);
+}
+
+
+// `spawnable_cmd` devuelve el comando externo en el que termina `cmd` tras
+// saltar sus redirecciones, o NULL si `cmd` es un bloque, un comando interno
+// o un comando vacío. Sólo esos casos necesitan un `fork` completo del shell.
+
+struct execcmd* spawnable_cmd(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
 
-        // Mientras no se hayan creado tantos procesos hijo como
-        // ficheros hay que procesar...
-        while (num_children < num_files)
-        {
-            // Si no se ha alcanzado PROCS, crear un nuevo proceso...
-            while (procesos_en_vuelo < PROCS)
-            {
-                int pid = fork();
+    while (cmd->type == REDR)
+        cmd = ((struct redrcmd*) cmd)->cmd;
 
-                if ( pid == -1 )
-                {
-                    perror("fork");
-                    exit(EXIT_FAILURE);
-                }
+    if (cmd->type != EXEC)
+        return NULL;
 
-                // CHILD execution.
-                if (pid == 0)
-                {
-                    int fd = open(file_names[num_children], O_RDONLY);
+    ecmd = (struct execcmd*) cmd;
+    if (ecmd->argv[0] == NULL || is_internal_cmd(ecmd->argv[0]))
+        return NULL;
 
-                    if ( fd < 0 )
-                    {
-                        perror("open");
-                        exit(EXIT_FAILURE);
-                    }
+    return ecmd;
+}
 
-                    if (NBYTES != 1024) escribir_bytes(fd, file_names[num_children], NBYTES, BSIZE);
-                    else if (NLINES != 0) escribir_lineas(fd, file_names[num_children], NLINES, BSIZE);
-                    else escribir_bytes(fd, file_names[num_children], NBYTES, BSIZE);
 
-                    if ( close(fd) == -1 ) 
-                    {
-                        perror("close");
-                        exit(EXIT_FAILURE);
-                    } 
+// `spawn_cmd` lanza el comando externo `cmd` con `posix_spawn`, que en glibc
+// usa `clone(CLONE_VM|CLONE_VFORK)` y evita copiar las tablas de páginas del
+// shell. Las acciones que ya contenga `fa` (p.ej. los `dup2` de una tubería)
+// se aplican antes que las redirecciones de `cmd`, en el mismo orden que en
+// la ruta con `fork`. Si `mask` no es NULL, el hijo arranca con esa máscara
+// de señales. La ruta del ejecutable se obtiene de la tabla hash de comandos.
+//
+// `spawn_cmd` devuelve el pid del hijo o -1 si no se pudo lanzar.
 
-                    exit(EXIT_SUCCESS);
-                }
-                // PARENT execution.
-                // Almacenar PID del proceso creado. 
-                for (int i = 0; i < PROCS; i++)
-                    if (!running_pids[i]) { running_pids[i] = pid; break; }
-                
-                // Actualizar variables de control. 
-                num_children++;
-                procesos_en_vuelo++;
-                
-                if(procesos_en_vuelo == num_files) break;
+// Cierra en el shell los `n` descriptores de `fds` abiertos para las
+// redirecciones de un comando lanzado con `spawn_cmd`
+void cerrar_redirecciones(int* fds, int n)
+{
+    for (int i = 0; i < n; i++)
+        TRY( close(fds[i]) );
+}
 
-            }
-            
-            // Esperar al proceso más antigüo...
-            oldest_pid = running_pids[0];
-            for(int i = 0; i < PROCS; i++) {
-                if ( running_pids[i] < oldest_pid ) 
-                {
-                    oldest_pid = running_pids[i];
-                }
-            }
 
-            int ret;
-            if ((ret = waitpid(oldest_pid, &status, 0)) > 0)
-            {
-                for (int i = 0; i < PROCS; i++)
-                {
-                    if (ret == running_pids[i])
-                    {
-                        running_pids[i] = 0;
-                        procesos_en_vuelo--;
-                        procesos_terminados++;
-                        break;
-                    }
-                }
-            }
-            
-        }
+pid_t spawn_cmd(struct cmd* cmd, posix_spawn_file_actions_t* fa, const sigset_t* mask)
+{
+    struct execcmd* ecmd;
+    struct redrcmd* rcmd;
+    struct cmd* c;
+    posix_spawnattr_t attr;
+    const char* path;
+    pid_t pid;
+    int err, n;
+
+    ecmd = spawnable_cmd(cmd);
+    assert(ecmd != NULL);
 
-        for(int i = 0; i < num_children-procesos_terminados; i++)
+    if ((path = hash_lookup(ecmd->argv[0])) == NULL)
+    {
+        error("no se encontró el comando '%s'\n", ecmd->argv[0]);
+        return -1;
+    }
+
+    // Los ficheros de las redirecciones se abren aquí y no con `addopen`:
+    // si `posix_spawn` fallara al abrirlos sólo devolvería el `errno`, sin
+    // decir qué fichero ni que el fallo no es del comando
+    for (n = 0, c = cmd; c->type == REDR; c = ((struct redrcmd*) c)->cmd)
+        n++;
+    int rfds[n > 0 ? n : 1];
+
+    // Redirecciones de fuera hacia dentro: la más interna prevalece
+    for (n = 0, c = cmd; c->type == REDR; c = rcmd->cmd)
+    {
+        rcmd = (struct redrcmd*) c;
+        if ((rfds[n] = open(rcmd->file, rcmd->flags, rcmd->mode)) == -1)
         {
-            int hijo = waitpid(-1, &status, 0);
+            error("open: %s: %s\n", rcmd->file, strerror(errno));
+            cerrar_redirecciones(rfds, n);
+            return -1;
+        }
+        n++;
+        if (rfds[n - 1] != rcmd->fd)
+        {
+            posix_spawn_file_actions_adddup2(fa, rfds[n - 1], rcmd->fd);
+            posix_spawn_file_actions_addclose(fa, rfds[n - 1]);
         }
-        unblock_sigchld();
     }
-    else
+
+    if ((err = posix_spawnattr_init(&attr)) != 0)
     {
-        for (int i = 0; i < num_files; i++)
-        {
-            int fd = open(file_names[i], O_RDONLY);
+        error("posix_spawnattr_init: %s\n", strerror(err));
+        cerrar_redirecciones(rfds, n);
+        return -1;
+    }
+    if (mask)
+    {
+        posix_spawnattr_setsigmask(&attr, mask);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    }
 
-            if ( fd < 0 )
-            {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
+    fflush(stdout);
+    err = posix_spawn(&pid, path, fa, &attr, ecmd->argv, environ);
+    posix_spawnattr_destroy(&attr);
+    cerrar_redirecciones(rfds, n);
 
-            if (NBYTES != 1024) escribir_bytes(fd, file_names[i], NBYTES, BSIZE);
-            else if (NLINES != 0) escribir_lineas(fd, file_names[i], NLINES, BSIZE);
-            else escribir_bytes(fd, file_names[i], NBYTES, BSIZE);
-        
-            if ( close(fd) == -1 )
-            {
-                perror("close");
-                exit(EXIT_FAILURE);
-            }
-        }
+    if (err != 0)
+    {
+        error("%s: %s\n", ecmd->argv[0], strerror(err));
+        return -1;
     }
+
+    return pid;
 }
 
 
-// Comando BJOBS
-void run_bjobs(struct execcmd* ecmd)
+// Lanza `cmd` con `spawn_cmd` y espera a que termine. SIGCHLD se bloquea
+// mientras tanto: el padre sólo se reanuda cuando el hijo ya ha hecho `exec`,
+// y un comando corto podría terminar (y ser recogido por `handle_sigchld`)
+// antes de llegar al `waitpid`.
+void spawn_and_wait(struct cmd* cmd)
 {
-    int opt;
-    optind = 1;
+    posix_spawn_file_actions_t fa;
+    sigset_t mask_one, prev_one;
+    struct timespec t0;
+    pid_t pid;
+    int status;
 
-    while ((opt = getopt(ecmd->argc, ecmd->argv, "kh")) != -1)
-    {
-        switch (opt)
-        {
-            case 'k':
-                // Matamos a todos los procesos en segundo plano
-                for(int i = 0; i<NUM_BG_PIDS; i++){
-                if(BG_PIDS[i])
-                    if ( kill(BG_PIDS[i], SIGKILL) == -1)
-                    {
-                        perror("kill");
-                        exit(EXIT_FAILURE);
-                    }
-                }
-                return;
-            case 'h':
-                printf("Uso: %s [-k] [-h]\n", ecmd->argv[0]);
-                printf("     Opciones:\n");
-                printf("     -k Mata todos los procesos en segundo plano.\n");
-                printf("     -h Ayuda\n");
-                return;
+    sigemptyset(&mask_one);
+    sigaddset(&mask_one, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
 
-            default:
-                return;
-        }   
-    }   
+    time_lanzar(&t0);
+    posix_spawn_file_actions_init(&fa);
+    pid = spawn_cmd(cmd, &fa, &prev_one);
+    posix_spawn_file_actions_destroy(&fa);
 
-    // Mostramos los procesos que estan en segundo plano
-    for(int i = 0; i<NUM_BG_PIDS; i++){
-        if(BG_PIDS[i])
-            printf("[%d]\n", BG_PIDS[i]);
-    }
+    if (pid > 0)
+        esperar_hijo(pid, &status, cmd, &t0);
 
+    sigprocmask(SIG_SETMASK, &prev_one, NULL);
 }
 
 
-void run_internal_cmd(struct execcmd* ecmd) 
-{
-	if (strcmp(ecmd->argv[0], "cwd") == 0)       run_cwd();
-	else if (strcmp(ecmd->argv[0], "exit") == 0) run_exit();
-	else if (strcmp(ecmd->argv[0], "cd") == 0)
-	{
-	    if (ecmd->argc > 2) printf("run_cd: Demasiados argumentos\n");
-	    else run_cd(ecmd->argv[1]);
-	}
-    else if (strcmp(ecmd->argv[0], "psplit") == 0) run_psplit(ecmd);
-    else if (strcmp(ecmd->argv[0], "bjobs") == 0) run_bjobs(ecmd);
-}
+// `run_pipe` ejecuta las N etapas de una tubería. Crea las N-1 tuberías antes
+// de lanzar nada, lanza todas las etapas directamente desde el shell (con
+// `spawn_cmd` o, si no es posible, con `fork`) y espera a cada una de ellas,
+// guardando su estado de salida en `pcmd->status`.
 
+void run_pipe(struct pipecmd* pcmd)
+{
+    struct execcmd* ecmd;
+    struct cmd* stage;
+    posix_spawn_file_actions_t fa;
+    int n = pcmd->ncmds;
+    int nfds = 2 * (n - 1);
+    int fds[nfds];
+    pid_t pids[n];
+    struct timespec t0[n];
+    int fd_in, fd_out;
+
+    for (int i = 0; i < n - 1; i++)
+    {
+        if (pipe(fds + 2 * i) < 0)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-/******************************************************************************
- * Funciones para la ejecución de la línea de órdenes
- ******************************************************************************/
+    block_sigchld();
+    for (int i = 0; i < n; i++)
+    {
+        stage = pcmd->cmds[i];
 
+        // La etapa i lee de la tubería i-1 y escribe en la tubería i
+        fd_in = i > 0 ? fds[2 * (i - 1)] : -1;
+        fd_out = i < n - 1 ? fds[2 * i + 1] : -1;
 
-void exec_cmd(struct execcmd* ecmd)
-{
-    assert(ecmd->type == EXEC);
+        time_lanzar(&t0[i]);
+        if (spawnable_cmd(stage))
+        {
+            posix_spawn_file_actions_init(&fa);
+            if (fd_in != -1)
+                posix_spawn_file_actions_adddup2(&fa, fd_in, STDIN_FILENO);
+            if (fd_out != -1)
+                posix_spawn_file_actions_adddup2(&fa, fd_out, STDOUT_FILENO);
+            for (int j = 0; j < nfds; j++)
+                posix_spawn_file_actions_addclose(&fa, fds[j]);
+            pids[i] = spawn_cmd(stage, &fa, NULL);
+            posix_spawn_file_actions_destroy(&fa);
+            continue;
+        }
 
-    if (ecmd->argv[0] == NULL) exit(EXIT_SUCCESS);
+        if ((pids[i] = fork_or_panic("fork PIPE")) == 0)
+        {
+            if (fd_in != -1)
+                TRY( dup2(fd_in, STDIN_FILENO) );
+            if (fd_out != -1)
+                TRY( dup2(fd_out, STDOUT_FILENO) );
+            for (int j = 0; j < nfds; j++)
+                TRY( close(fds[j]) );
+
+            if (stage->type == EXEC) {
+                ecmd = (struct execcmd*) stage;
+                if (is_internal_cmd(ecmd->argv[0]) == 1)
+                    run_internal_cmd(ecmd);
+                else
+                    exec_cmd(ecmd);
+            } else
+                run_cmd(stage);
+            exit(EXIT_SUCCESS);
+        }
+    }
 
-    execvp(ecmd->argv[0], ecmd->argv);
+    for (int j = 0; j < nfds; j++)
+        TRY( close(fds[j]) );
 
-    panic("no se encontró el comando '%s'\n", ecmd->argv[0]);
+    // Esperar a todas las etapas
+    for (int i = 0; i < n; i++)
+        pcmd->status[i] = -1;
+    if (g_time.activo)
+        esperar_etapas(pcmd, pids, t0);
+    else
+        for (int i = 0; i < n; i++)
+            if (pids[i] > 0)
+                TRY( waitpid(pids[i], &pcmd->status[i], 0) );
+    for (int i = 0; i < n; i++)
+        DPRINTF(DBG_TRACE, "etapa %d: estado %d\n", i, pcmd->status[i]);
+    unblock_sigchld();
 }
 
 
@@ -1643,10 +4764,9 @@ void run_cmd(struct cmd* cmd)
     struct pipecmd* pcmd;
     struct backcmd* bcmd;
     struct subscmd* scmd;
-    int p[2];
+    struct timespec t0;
     int fd;
     int pid, status;
-    int pidD, pidI;
     sigset_t mask_all, mask_one, prev_one;
 
     DPRINTF(DBG_TRACE, "STR\n");
@@ -1661,10 +4781,13 @@ void run_cmd(struct cmd* cmd)
 	    	//Comprobacion de si es comando interno o externo
 	    	if (is_internal_cmd(ecmd->argv[0]) == 1) {
 	    		run_internal_cmd(ecmd);
+	    	} else if (spawnable_cmd(cmd)) {
+                spawn_and_wait(cmd);
 	    	} else {
+            	time_lanzar(&t0);
             	if ((pid = fork_or_panic("fork EXEC")) == 0)
                 	exec_cmd(ecmd);
-            	TRY( waitpid(pid, &status, 0) );
+            	esperar_hijo(pid, &status, cmd, &t0);
 	    	}
             break;
 
@@ -1690,6 +4813,12 @@ void run_cmd(struct cmd* cmd)
                     break;
                 }
             }
+            if (spawnable_cmd(cmd))
+            {
+                spawn_and_wait(cmd);
+                break;
+            }
+            time_lanzar(&t0);
             if ((pid = fork_or_panic("fork REDR")) == 0)
             {
                 TRY( close(rcmd->fd) );
@@ -1704,7 +4833,7 @@ void run_cmd(struct cmd* cmd)
                     run_cmd(rcmd->cmd);
                 exit(EXIT_SUCCESS);
             }
-            TRY( waitpid(pid, &status, 0) );
+            esperar_hijo(pid, &status, cmd, &t0);
             break;
 
         case LIST:
@@ -1714,59 +4843,8 @@ void run_cmd(struct cmd* cmd)
             break;
 
         case PIPE:
-            pcmd = (struct pipecmd*)cmd;
-
-            if (pipe(p) < 0)
-            {
-                perror("pipe");
-                exit(EXIT_FAILURE);
-            }
-
-            // Ejecución del hijo de la izquierda
-            block_sigchld();
-            if ((pidI = fork_or_panic("fork PIPE left")) == 0)
-            {
-                TRY( close(STDOUT_FILENO) );
-                TRY( dup(p[1]) );
-                TRY( close(p[0]) );
-                TRY( close(p[1]) );
-                if (pcmd->left->type == EXEC) {
-                    ecmd = ((struct execcmd*) pcmd->left);
-                    if (is_internal_cmd(ecmd->argv[0]) == 1)
-						run_internal_cmd(ecmd);
-                    else
-                        exec_cmd((struct execcmd*) pcmd->left);
-                } else
-                    run_cmd(pcmd->left);
-                exit(EXIT_SUCCESS);
-            }
-
-            // Ejecución del hijo de la derecha
-            if ((pidD = fork_or_panic("fork PIPE right")) == 0)
-            {
-                TRY( close(STDIN_FILENO) );
-                TRY( dup(p[0]) );
-                TRY( close(p[0]) );
-                TRY( close(p[1]) );
-
-				// Comprobar si es interno
-                if (pcmd->right->type == EXEC) {
-                    ecmd = ((struct execcmd*) pcmd->right);
-                    if (is_internal_cmd(ecmd->argv[0]) == 1)
-						run_internal_cmd(ecmd);
-                    else
-                        exec_cmd((struct execcmd*) pcmd->right);
-                } else
-                    run_cmd(pcmd->right);
-                exit(EXIT_SUCCESS);
-            }
-            TRY( close(p[0]) );
-            TRY( close(p[1]) );
-
-            // Esperar a ambos hijos
-            TRY( waitpid(pidI, &status, 0) );
-            TRY( waitpid(pidD, &status, 0) );
-            unblock_sigchld();
+            pcmd = (struct pipecmd*) cmd;
+            run_pipe(pcmd);
             break;
 
         case BACK:
@@ -1778,7 +4856,20 @@ void run_cmd(struct cmd* cmd)
             bcmd = (struct backcmd*)cmd;
 
             sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
-            if ((pid = fork_or_panic("fork BACK")) == 0)
+            if (spawnable_cmd(bcmd->cmd))
+            {
+                posix_spawn_file_actions_t fa;
+
+                posix_spawn_file_actions_init(&fa);
+                pid = spawn_cmd(bcmd->cmd, &fa, &prev_one);
+                posix_spawn_file_actions_destroy(&fa);
+                if (pid < 0)
+                {
+                    sigprocmask(SIG_SETMASK, &prev_one, NULL);
+                    break;
+                }
+            }
+            else if ((pid = fork_or_panic("fork BACK")) == 0)
             {   
                 sigprocmask(SIG_SETMASK, &prev_one, NULL);
                 if (bcmd->cmd->type == EXEC) {
@@ -1804,11 +4895,16 @@ void run_cmd(struct cmd* cmd)
 
         case SUBS:
             scmd = (struct subscmd*) cmd;
+            time_lanzar(&t0);
             if ((pid =fork_or_panic("fork SUBS")) == 0) {
                 run_cmd(scmd->cmd);
                 exit(EXIT_SUCCESS);
             }
-            TRY( waitpid(pid, &status, 0) );
+            esperar_hijo(pid, &status, cmd, &t0);
+            break;
+
+        case TIME:
+            run_time((struct timecmd*) cmd);
             break;
 
         case INV:
@@ -1858,17 +4954,15 @@ void print_cmd(struct cmd* cmd)
 
         case PIPE:
             pcmd = (struct pipecmd*) cmd;
-            printf("fork( ");
-            if (pcmd->left->type == EXEC)
-                printf("exec ( %s )", ((struct execcmd*) pcmd->left)->argv[0]);
-            else
-                print_cmd(pcmd->left);
-            printf(" ) => fork( ");
-            if (pcmd->right->type == EXEC)
-                printf("exec ( %s )", ((struct execcmd*) pcmd->right)->argv[0]);
-            else
-                print_cmd(pcmd->right);
-            printf(" )");
+            for (int i = 0; i < pcmd->ncmds; i++)
+            {
+                printf(i ? " => fork( " : "fork( ");
+                if (pcmd->cmds[i]->type == EXEC)
+                    printf("exec ( %s )", ((struct execcmd*) pcmd->cmds[i])->argv[0]);
+                else
+                    print_cmd(pcmd->cmds[i]);
+                printf(" )");
+            }
             break;
 
         case BACK:
@@ -1888,6 +4982,12 @@ void print_cmd(struct cmd* cmd)
             printf(" )");
             break;
 
+        case TIME:
+            printf("time( ");
+            print_cmd(((struct timecmd*) cmd)->cmd);
+            printf(" )");
+            break;
+
         case INV:
         default:
             panic("%s: estructura `cmd` desconocida\n", __func__);
@@ -1904,33 +5004,32 @@ void print_cmd(struct cmd* cmd)
 // biblioteca readline. Ésta permite mantener el historial, utilizar las flechas
 // para acceder a las órdenes previas del historial, búsquedas de órdenes, etc.
 
+//
+// El usuario (`g_user`) y el directorio actual (`g_cwd`) están precalculados;
+// el prompt sólo se reconstruye cuando `cd` cambia de directorio.
+
 char* get_cmd()
 {
     char* buf;
 
-    uid_t uid = getuid();
-    struct passwd* passwd = getpwuid(uid);
-
-    if(!passwd) 
+    if (g_prompt_stale)
     {
-	    perror("getpwuid");
-	    exit(EXIT_FAILURE);
-    }
-    char* user = passwd -> pw_name;
+        char path[PATH_MAX];
+        strcpy(path, g_cwd);
 
-    char path[PATH_MAX];
-    if(!getcwd(path, PATH_MAX))
-    {
-	    perror("getcwd");
-	    exit(EXIT_FAILURE);
+        char *dir = basename(path);
+        free(g_prompt);
+        if ((g_prompt = malloc(strlen(g_user)+strlen(dir)+4)) == NULL)
+        {
+            perror("get_cmd: malloc");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(g_prompt, "%s@%s> ", g_user, dir);
+        g_prompt_stale = 0;
     }
 
-    char *dir = basename(path);
-    char prompt[strlen(user)+strlen(dir)+4];
-    sprintf(prompt, "%s@%s> ", user, dir);
-
     // Lee la orden tecleada por el usuario
-    buf = readline(prompt);
+    buf = readline(g_prompt);
 
     // Si el usuario ha escrito una orden, almacenarla en la historia.
     if(buf) add_history(buf);
@@ -1939,6 +5038,142 @@ char* get_cmd()
 }
 
 
+// Entrada de los modos no interactivos (`-c` y fichero de órdenes). El
+// fichero se lee con `read` en un buffer propio y no con stdio: su
+// descriptor (y su posición) se comparte con los hijos creados con `fork`,
+// y el `exit` de un hijo con un `FILE*` de lectura pendiente reposicionaría
+// el fichero y el shell volvería a ejecutar líneas ya leídas.
+struct batch_input {
+    int fd;         // -1 con `-c` (la cadena completa ya está en `buf`)
+    char* buf;
+    size_t size;    // Capacidad de `buf`
+    size_t len;     // Bytes válidos en `buf`
+    size_t off;     // Inicio de la siguiente línea
+    int eof;
+};
+
+static struct batch_input* g_batch_input = NULL;
+
+
+// Lee más datos del fichero de órdenes tras descartar las líneas ya
+// consumidas, ampliando el buffer si una línea no cabe.
+static void batch_leer(struct batch_input* b)
+{
+    ssize_t n;
+
+    memmove(b->buf, b->buf + b->off, b->len - b->off);
+    b->len -= b->off;
+    b->off = 0;
+
+    if (b->len + 1 == b->size)
+    {
+        if ((b->buf = realloc(b->buf, 2 * b->size)) == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        b->size *= 2;
+    }
+
+    while ((n = read(b->fd, b->buf + b->len, b->size - b->len - 1)) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (n == 0)
+        b->eof = 1;
+    b->len += n;
+}
+
+
+// `get_cmd_batch` lee la siguiente línea de `g_batch_input` sin prompt, sin
+// historial y sin readline. Devuelve un puntero al buffer de entrada, válido
+// hasta la siguiente llamada, o NULL al final de la entrada. Las líneas
+// en blanco y las que empiezan por '#' (comentarios, `#!`), aunque vaya
+// precedido de espacios, se saltan.
+
+char* get_cmd_batch()
+{
+    struct batch_input* b = g_batch_input;
+    char* line;
+    char* nl;
+
+    for (;;)
+    {
+        nl = memchr(b->buf + b->off, '\n', b->len - b->off);
+        if (nl == NULL && !b->eof)
+        {
+            batch_leer(b);
+            continue;
+        }
+        if (nl == NULL && b->off == b->len)
+            return NULL;
+
+        // La última línea puede no terminar en '\n': siempre queda un byte
+        // libre tras `len` para el terminador
+        line = b->buf + b->off;
+        if (nl == NULL)
+        {
+            nl = b->buf + b->len;
+            b->off = b->len;
+        }
+        else
+            b->off = nl - b->buf + 1;
+        *nl = 0;
+
+        char* s = line;
+        while (IS_WHITESPACE(*s))
+            s++;
+
+        if (*s != 0 && *s != '#')
+            return line;
+    }
+}
+
+
+// Prepara `g_batch_input` para leer del descriptor `fd` o, si `fd` es -1,
+// de la cadena `str`
+void set_batch_input(int fd, const char* str)
+{
+    struct batch_input* b;
+
+    if ((b = calloc(1, sizeof(*b))) == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    b->fd = fd;
+    b->eof = fd < 0;
+    b->size = fd < 0 ? strlen(str) + 1 : BATCH_BUFSIZE;
+    if ((b->buf = malloc(b->size)) == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (fd < 0)
+    {
+        memcpy(b->buf, str, b->size);
+        b->len = b->size - 1;
+    }
+    g_batch_input = b;
+}
+
+
+// Libera `g_batch_input` y cierra su fichero
+void close_batch_input()
+{
+    if (g_batch_input->fd >= 0)
+        TRY( close(g_batch_input->fd) );
+    free(g_batch_input->buf);
+    free(g_batch_input);
+    g_batch_input = NULL;
+}
+
+
 /******************************************************************************
  * Bucle principal de `simplesh`
  ******************************************************************************/
@@ -1946,11 +5181,13 @@ char* get_cmd()
 
 void help(char **argv)
 {
-    info("Usage: %s [-d N] [-h]\n\
+    info("Usage: %s [-d N] [-h] [-c CMDS | FILE]\n\
          shell simplesh v%s\n\
          Options: \n\
          -d set debug level to N\n\
-         -h help\n\n",
+         -c run CMDS without prompt and exit\n\
+         -h help\n\
+         FILE run the commands in FILE without prompt and exit\n\n",
          argv[0], VERSION);
 }
 
@@ -1960,11 +5197,14 @@ void parse_args(int argc, char** argv)
     int option;
 
     // Bucle de procesamiento de parámetros
-    while((option = getopt(argc, argv, "d:h")) != -1) {
+    while((option = getopt(argc, argv, "d:c:h")) != -1) {
         switch(option) {
             case 'd':
                 g_dbg_level = atoi(optarg);
                 break;
+            case 'c':
+                set_batch_input(-1, optarg);
+                break;
             case 'h':
             default:
                 help(argv);
@@ -1972,6 +5212,19 @@ void parse_args(int argc, char** argv)
                 break;
         }
     }
+
+    // Fichero de órdenes
+    if (optind < argc && g_batch_input == NULL)
+    {
+        int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+        {
+            perror(argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+        set_batch_input(fd, NULL);
+    }
 }
 
 
@@ -2042,13 +5295,21 @@ int main(int argc, char** argv)
     }
 
     char* buf;
+    char* (*read_cmd)();
 
     parse_args(argc, argv);
 
+    // En modo no interactivo no se construye el prompt ni se usa readline
+    read_cmd = g_batch_input ? get_cmd_batch : get_cmd;
+
+    update_cwd();
+    if (!g_batch_input)
+        resolve_user();
+
     DPRINTF(DBG_TRACE, "STR\n");
 
     // Bucle de lectura y ejecución de órdenes
-    while ((buf = get_cmd()) != NULL)
+    while ((buf = read_cmd()) != NULL)
     {
         // Realiza el análisis sintáctico de la línea de órdenes
         cmd = parse_cmd(buf);
@@ -2064,13 +5325,20 @@ int main(int argc, char** argv)
         // Ejecuta la línea de órdenes
         run_cmd(cmd);
 
-        // Libera la memoria de las estructuras `cmd`
-        free_cmd(cmd);
+        // Libera de golpe la memoria de las estructuras `cmd`
+        arena_reset();
 
-        // Libera la memoria de la línea de órdenes
-        free(buf);
+        // Libera la memoria de la línea de órdenes (readline)
+        if (!g_batch_input)
+            free(buf);
     }
 
+    arena_destroy();
+    free(g_prompt);
+    free(g_user);
+    if (g_batch_input)
+        close_batch_input();
+
     DPRINTF(DBG_TRACE, "END\n");
 
     return 0;